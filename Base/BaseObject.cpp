@@ -1,7 +1,7 @@
 #include "BaseObject.h"
-#include "Math/ParSplineCalc.h"
 #include "Data/TimeEvents.h"
 #include "Data/MassSpec.h"
+#include "Data/Ingest.h"
 #include "Math/MassSpecSummator.h"
 
 MyInit * MyInit::s_instance;
@@ -15,11 +15,11 @@ MyInit::MyInit(QObject * parent)
     if(s_instance) throw std::runtime_error
             ("Tryed to create second MyInit instance!");
     s_instance = this;
-    new ParSplineCalc(this);
     mMassSpec.reset(new MassSpec);
     mTimeEvents.reset(new TimeEvents);
     mTimeParams.reset(new TimeParams);
     mMassSpecsColl.reset(new MassSpectrumsCollection);
+    mIngest.reset(new Ingest(timeEvents(), massSpecColl()));
 
     moveToThread(massSpecColl());
     moveToThread(massSpec());
@@ -39,12 +39,15 @@ MyInit::MyInit(QObject * parent)
         SLOT(blockingAddMassSpec(TimeEventsContainer))
     );
 
+    //Collection is cleared synchronously, so the ingest never meets
+    //spectra of the previous data
     connect
     (
         timeEvents(),
         SIGNAL(cleared()),
         massSpecColl(),
-        SLOT(blockingClear())
+        SLOT(blockingClear()),
+        Qt::DirectConnection
     );
 }
 
@@ -77,6 +80,11 @@ MassSpectrumsCollection *MyInit::massSpecColl()
     return mMassSpecsColl.data();
 }
 
+Ingest *MyInit::ingest()
+{
+    return mIngest.data();
+}
+
 int MyInit::precision()
 {
     return mRealNumPrecision;
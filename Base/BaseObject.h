@@ -12,6 +12,7 @@ class TimeEvents;
 class MassSpec;
 class TimeParams;
 class MassSpectrumsCollection;
+class Ingest;
 class MyInit : public QObject
 {
     Q_OBJECT
@@ -34,6 +35,8 @@ public:
 
     MassSpectrumsCollection * massSpecColl();
 
+    Ingest * ingest();
+
     int precision();
     void setPrecision(int prec);
     Q_SIGNAL void precisionNotify(int);
@@ -44,6 +47,7 @@ private:
     QScopedPointer<MassSpec> mMassSpec;
     QScopedPointer<TimeParams> mTimeParams;
     QScopedPointer<MassSpectrumsCollection> mMassSpecsColl;
+    QScopedPointer<Ingest> mIngest;
     int mRealNumPrecision;
 };
 
@@ -0,0 +1,163 @@
+#include "Job.h"
+#include <QtConcurrent>
+#include <QProgressDialog>
+#include <QEventLoop>
+
+namespace
+{
+thread_local Job * t_current = nullptr;
+}
+
+Job::Scope::Scope(Job *job)
+    :
+      mPrev(t_current)
+{
+    t_current = job;
+}
+
+Job::Scope::~Scope()
+{
+    t_current = mPrev;
+}
+
+Job::Job(const QString &name, QObject *parent)
+    :
+      QObject(parent),
+      mName(name),
+      mCancelled(false),
+      mPercent(-1),
+      mLastNotifyMs(0),
+      mFinished(false)
+{
+    mTimer.start();
+}
+
+const QString &Job::name() const
+{
+    return mName;
+}
+
+bool Job::isCancelled() const
+{
+    return mCancelled.load(std::memory_order_relaxed);
+}
+
+void Job::checkpoint() const
+{
+    if(isCancelled()) throw Cancelled();
+}
+
+void Job::setProgress(qint64 done, qint64 total)
+{
+    const int percent = total > 0 ? static_cast<int>(qBound<qint64>(0, done * 100 / total, 100)) : 0;
+    if(mPercent.load() == percent) return;
+    const qint64 now = mTimer.elapsed();
+    //Throttled percent is not recorded so that the next call emits it
+    if(percent != 100 && now - mLastNotifyMs < s_progressIntervalMs) return;
+    mLastNotifyMs = now;
+    mPercent.store(percent);
+    Q_EMIT progressNotify(percent);
+}
+
+void Job::fail(const QString &message)
+{
+    cancel();
+    Q_EMIT failed(message);
+}
+
+void Job::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFinished = true;
+    }
+    mDone.notify_all();
+    Q_EMIT finished();
+}
+
+bool Job::isFinished() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFinished;
+}
+
+void Job::wait()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [this]{ return mFinished; });
+}
+
+Job *Job::current()
+{
+    return t_current;
+}
+
+void Job::check()
+{
+    if(t_current) t_current->checkpoint();
+}
+
+void Job::report(qint64 done, qint64 total)
+{
+    if(t_current) t_current->setProgress(done, total);
+}
+
+bool Job::runModal(QWidget *parent, const QString &name, std::function<void ()> fun)
+{
+    if(t_current)
+    {
+        fun();
+        return true;
+    }
+    Job job(name);
+    QProgressDialog dialog(name, tr("Cancel"), 0, 100, parent);
+    //Dialog blocks input from the start, since the GUI must not change
+    //the data while fun is running
+    dialog.setWindowModality(Qt::ApplicationModal);
+    dialog.setMinimumDuration(0);
+    //Reaching 100% must not hide the dialog before fun returns
+    dialog.setAutoReset(false);
+    dialog.setAutoClose(false);
+    dialog.setValue(0);
+    dialog.show();
+    QEventLoop loop;
+    connect(&job, SIGNAL(progressNotify(int)), &dialog, SLOT(setValue(int)));
+    connect(&dialog, SIGNAL(canceled()), &job, SLOT(cancel()));
+    connect(&job, SIGNAL(finished()), &loop, SLOT(quit()), Qt::QueuedConnection);
+
+    std::exception_ptr error;
+    QtConcurrent::run([&]()->void
+    {
+        Job::Scope scope(&job);
+        try
+        {
+            fun();
+        }
+        catch(...)
+        {
+            error = std::current_exception();
+        }
+        job.finish();
+    });
+    //Quit is queued, so it is not lost if job finishes before exec
+    loop.exec();
+    job.wait();
+
+    if(error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch(const Cancelled&)
+        {
+            return false;
+        }
+    }
+    return !job.isCancelled();
+}
+
+void Job::cancel()
+{
+    mCancelled = true;
+}
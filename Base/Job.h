@@ -0,0 +1,133 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+class QWidget;
+
+/**
+ * @brief The Job class is a handle of long running operation. Operation
+ * checks cancellation at its checkpoints and reports progress, which is
+ * passed to the listeners not more often than once per s_progressIntervalMs.
+ * A job is made current for a thread by Job::Scope, so deep computations
+ * reach it by Job::current() without extra parameters
+ */
+class Job : public QObject
+{
+    Q_OBJECT
+public:
+    using Ptr = std::shared_ptr<Job>;
+
+    /**
+     * @brief The Cancelled class is thrown from checkpoints of cancelled job
+     */
+    class Cancelled : public std::runtime_error
+    {
+    public:
+        Cancelled() : std::runtime_error("Job is cancelled!") {}
+    };
+
+    /**
+     * @brief The Scope class makes job current for the calling thread
+     */
+    class Scope
+    {
+        Job * mPrev;
+    public:
+        explicit Scope(Job * job);
+        ~Scope();
+    };
+
+    static const qint64 s_progressIntervalMs = 100;
+
+    explicit Job(const QString& name = QString(), QObject * parent = nullptr);
+
+    const QString& name() const;
+
+    bool isCancelled() const;
+
+    /**
+     * @brief checkpoint throws Cancelled if job was cancelled
+     */
+    void checkpoint() const;
+
+    /**
+     * @brief setProgress reports done part of the job
+     * @param done
+     * @param total
+     */
+    void setProgress(qint64 done, qint64 total);
+
+    /**
+     * @brief fail reports error of the job to the listeners by failed signal
+     * and cancels the rest of the job. Errors of background jobs are not
+     * rethrown, so this is the only way they reach the user
+     * @param message
+     */
+    void fail(const QString& message);
+
+    /**
+     * @brief finish marks job as finished and wakes up waiting threads
+     */
+    void finish();
+    bool isFinished() const;
+
+    /**
+     * @brief wait blocks until finish is called
+     */
+    void wait();
+
+    /**
+     * @brief current job of the calling thread
+     * @return nullptr if there is no job
+     */
+    static Job * current();
+
+    /**
+     * @brief check is checkpoint of the current job, does nothing without job
+     */
+    static void check();
+
+    /**
+     * @brief report reports progress of the current job
+     */
+    static void report(qint64 done, qint64 total);
+
+    /**
+     * @brief runModal runs fun as a job in a worker thread and shows progress
+     * dialog with cancel button until it is done. The dialog is application
+     * modal and shown at once, so the GUI takes no input while fun is running.
+     * If a job is already current then fun is run in place as a part of it.
+     * Exceptions of fun are rethrown in the calling thread
+     * @return false if job was cancelled
+     */
+    static bool runModal(QWidget * parent, const QString& name, std::function<void()> fun);
+
+public Q_SLOTS:
+    void cancel();
+
+Q_SIGNALS:
+    void progressNotify(int percent);
+    void failed(const QString& message);
+    void finished();
+
+private:
+    const QString mName;
+    std::atomic<bool> mCancelled;
+    std::atomic<int> mPercent;
+    std::atomic<qint64> mLastNotifyMs;
+    QElapsedTimer mTimer;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mDone;
+    bool mFinished;
+};
+
+#endif // JOB_H
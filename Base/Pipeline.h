@@ -0,0 +1,443 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <QString>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief The BoundedQueue class is a blocking queue of limited capacity,
+ * producers wait while it is full which gives backpressure to the upstream
+ */
+template<class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        :
+          mCapacity(capacity),
+          mMaxSize(0),
+          mClosed(false)
+    {
+    }
+
+    /**
+     * @brief push waits while queue is full
+     * @return false if queue was closed
+     */
+    bool push(T&& item)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotFull.wait(lock, [this]{ return mClosed || mItems.size() < mCapacity; });
+        if(mClosed) return false;
+        mItems.push_back(std::move(item));
+        if(mItems.size() > mMaxSize) mMaxSize = mItems.size();
+        lock.unlock();
+        mNotEmpty.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief pop waits while queue is empty and not closed
+     * @return false if queue is closed and drained
+     */
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mNotEmpty.wait(lock, [this]{ return mClosed || !mItems.empty(); });
+        if(mItems.empty()) return false;
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        lock.unlock();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief close wakes all waiting threads, items left in queue can be
+     * popped but nothing can be pushed
+     */
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mClosed = true;
+        }
+        mNotFull.notify_all();
+        mNotEmpty.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mItems.size();
+    }
+
+    size_t maxSize() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mMaxSize;
+    }
+
+    size_t capacity() const
+    {
+        return mCapacity;
+    }
+
+private:
+    const size_t mCapacity;
+    mutable std::mutex mMutex;
+    std::condition_variable mNotFull;
+    std::condition_variable mNotEmpty;
+    std::deque<T> mItems;
+    size_t mMaxSize;
+    bool mClosed;
+};
+
+/**
+ * @brief The Pipeline class runs items through a chain of stages connected
+ * by bounded queues. Every stage has its own worker threads: parallel stages
+ * process items in any order, ordered stages have one worker which gets items
+ * in the order they were pushed to the pipeline and may emit any number of
+ * items downstream. The first exception of a stage body cancels the pipeline:
+ * the failed item and all items still in flight pass the later stages without
+ * their bodies, and new items are dropped
+ */
+template<class Item>
+class Pipeline
+{
+public:
+    using Emit = std::function<void(Item&&)>;
+    using Transform = std::function<void(Item&)>;
+    using Sequential = std::function<void(Item&, const Emit&)>;
+
+    /**
+     * @brief The StageStats struct keeps stage metrics since start
+     */
+    struct StageStats
+    {
+        QString name;
+        size_t workers;
+        size_t items;
+        //Processed items per second
+        double throughput;
+        //Fraction of workers time spent in stage body
+        double utilization;
+        //Input queue occupancy
+        size_t queued;
+        size_t maxQueued;
+        size_t capacity;
+    };
+
+    static const size_t s_defaultCapacity = 64;
+
+    explicit Pipeline(size_t capacity = s_defaultCapacity)
+        :
+          mCapacity(capacity),
+          mRunning(false),
+          mCancelled(false),
+          mSeq(0)
+    {
+    }
+
+    ~Pipeline()
+    {
+        try
+        {
+            finish();
+        }
+        catch(...)
+        {
+        }
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    /**
+     * @brief addStage appends stage which changes items in place
+     * @param nWorkers number of threads running the stage
+     */
+    void addStage(const QString& name, size_t nWorkers, Transform body)
+    {
+        std::unique_ptr<Stage> s(new Stage(name, nWorkers > 0 ? nWorkers : 1));
+        s->transform = std::move(body);
+        mStages.push_back(std::move(s));
+    }
+
+    /**
+     * @brief addOrderedStage appends stage with one worker which takes items
+     * in order of the pipeline input and emits items for the next stage
+     */
+    void addOrderedStage(const QString& name, Sequential body)
+    {
+        std::unique_ptr<Stage> s(new Stage(name, 1));
+        s->sequential = std::move(body);
+        mStages.push_back(std::move(s));
+    }
+
+    /**
+     * @brief start creates queues and threads of all stages
+     */
+    void start()
+    {
+        std::lock_guard<std::mutex> lock(mStateMutex);
+        if(mRunning) return;
+        if(mStages.empty())
+            throw std::runtime_error("Pipeline has no stages!");
+        mSeq = 0;
+        mError = nullptr;
+        mCancelled = false;
+        mStart = Clock::now();
+        for(std::unique_ptr<Stage>& s : mStages)
+        {
+            s->input.reset(new BoundedQueue<Entry>(mCapacity));
+            s->items = 0;
+            s->busyNs = 0;
+            s->live = s->nWorkers;
+            s->pending.clear();
+            s->next = 0;
+            s->outSeq = 0;
+        }
+        for(size_t i = 0; i < mStages.size(); ++i)
+            for(size_t j = 0; j < mStages[i]->nWorkers; ++j)
+                mThreads.emplace_back([this, i]{ work(i); });
+        mRunning = true;
+    }
+
+    /**
+     * @brief push passes item to the first stage, waits while its queue is full
+     * @return false if item was dropped because the pipeline was cancelled
+     */
+    bool push(Item&& item)
+    {
+        if(!mRunning)
+            throw std::runtime_error("Pipeline is not started!");
+        if(mCancelled) return false;
+        return mStages.front()->input->push(Entry(mSeq++, std::move(item)));
+    }
+
+    /**
+     * @brief finish waits until all pushed items pass the pipeline and stops
+     * threads, rethrows the first exception of stage bodies
+     */
+    void finish()
+    {
+        std::unique_lock<std::mutex> lock(mStateMutex);
+        if(!mRunning) return;
+        lock.unlock();
+        mStages.front()->input->close();
+        for(std::thread& t : mThreads) t.join();
+        mThreads.clear();
+        lock.lock();
+        mStop = Clock::now();
+        mRunning = false;
+        if(mError)
+        {
+            std::exception_ptr e = mError;
+            mError = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    bool isRunning() const
+    {
+        return mRunning;
+    }
+
+    /**
+     * @brief isCancelled true if a stage body has thrown since start
+     */
+    bool isCancelled() const
+    {
+        return mCancelled;
+    }
+
+    std::vector<StageStats> stats() const
+    {
+        std::lock_guard<std::mutex> lock(mStateMutex);
+        std::vector<StageStats> res;
+        const Clock::time_point now = mRunning ? Clock::now() : mStop;
+        const double sec = std::chrono::duration<double>(now - mStart).count();
+        for(const std::unique_ptr<Stage>& s : mStages)
+        {
+            StageStats st;
+            st.name = s->name;
+            st.workers = s->nWorkers;
+            st.items = s->items;
+            st.throughput = sec > 0. ? st.items / sec : 0.;
+            st.utilization = sec > 0. ? s->busyNs * 1e-9 / sec / s->nWorkers : 0.;
+            st.queued = s->input ? s->input->size() : 0;
+            st.maxQueued = s->input ? s->input->maxSize() : 0;
+            st.capacity = mCapacity;
+            res.push_back(st);
+        }
+        return res;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    //Item with its sequence number
+    struct Entry
+    {
+        Entry()
+            :
+              seq(0),
+              failed(false)
+        {
+        }
+
+        Entry(size_t seq, Item&& item)
+            :
+              seq(seq),
+              failed(false),
+              item(std::move(item))
+        {
+        }
+
+        size_t seq;
+        //Body of some stage has thrown on the item
+        bool failed;
+        Item item;
+    };
+
+    struct Stage
+    {
+        Stage(const QString& name, size_t nWorkers)
+            :
+              name(name),
+              nWorkers(nWorkers),
+              items(0),
+              busyNs(0),
+              live(0),
+              next(0),
+              outSeq(0)
+        {
+        }
+
+        const QString name;
+        const size_t nWorkers;
+        Transform transform;
+        Sequential sequential;
+        std::unique_ptr<BoundedQueue<Entry>> input;
+        std::atomic<size_t> items;
+        std::atomic<int64_t> busyNs;
+        //Workers which did not exit yet, the last one closes the next queue
+        std::atomic<size_t> live;
+        //Reorder buffer of ordered stage
+        std::map<size_t, Entry> pending;
+        size_t next;
+        size_t outSeq;
+    };
+
+    const size_t mCapacity;
+    std::vector<std::unique_ptr<Stage>> mStages;
+    std::vector<std::thread> mThreads;
+    //Guards running state and times read by stats
+    mutable std::mutex mStateMutex;
+    std::atomic<bool> mRunning;
+    std::atomic<bool> mCancelled;
+    size_t mSeq;
+    Clock::time_point mStart;
+    Clock::time_point mStop;
+    std::mutex mErrorMutex;
+    std::exception_ptr mError;
+
+    void forward(size_t i, Entry&& e)
+    {
+        if(i + 1 < mStages.size()) mStages[i + 1]->input->push(std::move(e));
+    }
+
+    //Runs body of stage s for entry e unless it or the pipeline has failed
+    void run(Stage& s, Entry& e, const std::function<void()>& body)
+    {
+        if(e.failed || mCancelled)
+        {
+            e.failed = true;
+            return;
+        }
+        const Clock::time_point start = Clock::now();
+        try
+        {
+            body();
+        }
+        catch(...)
+        {
+            e.failed = true;
+            cancel(std::current_exception());
+        }
+        s.busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>
+        (
+            Clock::now() - start
+        ).count();
+        ++s.items;
+    }
+
+    //Keeps the first error and stops taking new items
+    void cancel(std::exception_ptr error)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mErrorMutex);
+            if(!mError) mError = error;
+        }
+        mCancelled = true;
+        mStages.front()->input->close();
+    }
+
+    void work(size_t i)
+    {
+        Stage& s = *mStages[i];
+        Entry e;
+        while(s.input->pop(e))
+        {
+            if(s.sequential)
+            {
+                const size_t seq = e.seq;
+                s.pending.emplace(seq, std::move(e));
+                for
+                (
+                    auto it = s.pending.find(s.next);
+                    it != s.pending.end();
+                    it = s.pending.find(++s.next)
+                )
+                {
+                    Entry in = std::move(it->second);
+                    s.pending.erase(it);
+                    //Failed items emit nothing, so later stages never see them
+                    run(s, in, [&]
+                    {
+                        s.sequential(in.item, [&](Item&& out)
+                        {
+                            //Waiting for the next stage is not counted as busy time
+                            const Clock::time_point start = Clock::now();
+                            forward(i, Entry(s.outSeq++, std::move(out)));
+                            s.busyNs -= std::chrono::duration_cast<std::chrono::nanoseconds>
+                            (
+                                Clock::now() - start
+                            ).count();
+                        });
+                    });
+                }
+            }
+            else
+            {
+                run(s, e, [&]{ s.transform(e.item); });
+                forward(i, std::move(e));
+            }
+        }
+        if(--s.live == 0 && i + 1 < mStages.size())
+            mStages[i + 1]->input->close();
+    }
+};
+
+#endif // PIPELINE_H
@@ -1,40 +1,247 @@
 #include "ThreadPool.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-QMutex ThreadPool::s_mutex;
+namespace
+{
+//Queue index of the current thread, external threads share the last queue
+thread_local size_t t_queue = std::numeric_limits<size_t>::max();
+}
 
-QFuture<void> ThreadPool::parForAsync(size_t n, std::function<void (size_t)> Op)
+class ThreadPool::Scheduler
 {
-    QMutexLocker lock(&s_mutex);
-    using Sequence = QVector<std::function<void()>>;
+public:
+    struct Task
+    {
+        LoopBase * loop;
+        size_t first;
+        size_t last;
+    };
+
+    static Scheduler& instance()
+    {
+        static Scheduler scheduler;
+        return scheduler;
+    }
+
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mStop = true;
+        }
+        mWake.notify_all();
+        for(std::thread& t : mWorkers) t.join();
+        //Qt pool may be destroyed already at exit
+        if(QThreadPool * pool = QThreadPool::globalInstance())
+        {
+            for(size_t i = 0; i < mWorkers.size(); ++i) pool->releaseThread();
+        }
+    }
+
+    size_t threadsNum() const
+    {
+        return mWorkers.size() + 1;
+    }
+
+    void execute(LoopBase& loop, size_t first, size_t last)
+    {
+        const size_t q = t_queue < mQueues.size() ? t_queue : mQueues.size() - 1;
+        loop.mRemaining.store(last - first);
+        runRange(Task{&loop, first, last}, q);
+        //Help other workers until the loop is finished
+        Task t;
+        while(loop.mRemaining.load(std::memory_order_acquire) != 0)
+        {
+            if(take(q, t))
+            {
+                runRange(t, q);
+                continue;
+            }
+            //Last ranges are run by other threads, the caller sleeps until
+            //they finish or push more work
+            std::unique_lock<std::mutex> lock(mSleepMutex);
+            mSleeping.fetch_add(1);
+            mWake.wait(lock, [this, &loop]
+            {
+                return mQueued.load() != 0 ||
+                        loop.mRemaining.load(std::memory_order_acquire) == 0;
+            });
+            mSleeping.fetch_sub(1);
+        }
+        if(loop.mError) std::rethrow_exception(loop.mError);
+    }
+
+private:
+    class WorkQueue
+    {
+        std::mutex mMutex;
+        std::deque<Task> mTasks;
+    public:
+        void push(const Task& t)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(t);
+        }
+
+        //Owner takes the smallest and most recent range
+        bool pop(Task& t)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mTasks.empty()) return false;
+            t = mTasks.back();
+            mTasks.pop_back();
+            return true;
+        }
+
+        //Thief takes the largest and oldest range
+        bool steal(Task& t)
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if(mTasks.empty()) return false;
+            t = mTasks.front();
+            mTasks.pop_front();
+            return true;
+        }
+    };
 
-    size_t nThreads =
-            static_cast<size_t>(QThreadPool::globalInstance()->maxThreadCount());
-    size_t nn = n/nThreads + 1;
+    //Queues of workers and the queue of external threads
+    std::vector<std::unique_ptr<WorkQueue>> mQueues;
+    std::vector<std::thread> mWorkers;
 
-    static Sequence vFuns;
-    vFuns.clear();
+    std::atomic<size_t> mQueued;
+    std::atomic<size_t> mSleeping;
+    std::mutex mSleepMutex;
+    std::condition_variable mWake;
+    bool mStop;
 
-    for(size_t i = 0; i < n; i+=nn)
+    //Threads left to the Qt pool for load tasks, modal jobs and packing
+    static const int s_minQtThreads = 2;
+
+    Scheduler()
+        :
+          mQueued(0),
+          mSleeping(0),
+          mStop(false)
     {
-        size_t firstIdx = i,
-                lastIdx = i + nn > n ? n : i + nn;
+        //Workers share cores with the Qt pool, whose threads also call loops,
+        //so they are reserved there and the pool keeps the other half
+        QThreadPool * pool = QThreadPool::globalInstance();
+        const int nTotal = pool->maxThreadCount();
+        const int nQt = std::max(nTotal / 2, static_cast<int>(s_minQtThreads));
+        const size_t nWorkers = nTotal > nQt ? static_cast<size_t>(nTotal - nQt) : 0;
+        for(size_t i = 0; i < nWorkers; ++i) pool->reserveThread();
+        for(size_t i = 0; i <= nWorkers; ++i)
+            mQueues.emplace_back(new WorkQueue);
+        for(size_t i = 0; i < nWorkers; ++i)
+            mWorkers.emplace_back([this, i]{ work(i); });
+    }
 
-        vFuns.push_back([=]()->void
+    void push(size_t q, const Task& t)
+    {
+        mQueues[q]->push(t);
+        mQueued.fetch_add(1);
+        if(mSleeping.load() != 0)
         {
-            for(size_t i = firstIdx; i < lastIdx; ++i)
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mWake.notify_one();
+        }
+    }
+
+    bool take(size_t q, Task& t)
+    {
+        if(mQueued.load() == 0) return false;
+        bool taken = mQueues[q]->pop(t);
+        for(size_t i = 1; !taken && i < mQueues.size(); ++i)
+            taken = mQueues[(q + i) % mQueues.size()]->steal(t);
+        if(taken) mQueued.fetch_sub(1);
+        return taken;
+    }
+
+    void runRange(Task t, size_t q)
+    {
+        LoopBase * loop = t.loop;
+        while(t.last - t.first > loop->mGrain)
+        {
+            const size_t mid = t.first + (t.last - t.first) / 2;
+            push(q, Task{loop, mid, t.last});
+            t.last = mid;
+        }
+        if(!loop->mFailed.load(std::memory_order_relaxed))
+        {
+            try
             {
-                Op(i);
+                loop->run(t.first, t.last);
             }
-        });
+            catch(...)
+            {
+                if(!loop->mFailed.exchange(true))
+                    loop->mError = std::current_exception();
+            }
+        }
+        //The loop may be destroyed by its owner right after this
+        const size_t n = t.last - t.first;
+        if(loop->mRemaining.fetch_sub(n, std::memory_order_acq_rel) == n)
+        {
+            //Owner of the finished loop may sleep in execute
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mWake.notify_all();
+        }
     }
-    return QtConcurrent::map<Sequence>
-            (vFuns, [](std::function<void()> f)
+
+    void work(size_t q)
     {
-        f();
+        t_queue = q;
+        Task t;
+        for(;;)
+        {
+            if(take(q, t))
+            {
+                runRange(t, q);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mSleepMutex);
+            mSleeping.fetch_add(1);
+            mWake.wait(lock, [this]{ return mStop || mQueued.load() != 0; });
+            mSleeping.fetch_sub(1);
+            if(mStop) return;
+        }
+    }
+};
+
+QFuture<void> ThreadPool::parForAsync(size_t n, std::function<void (size_t)> Op)
+{
+    return QtConcurrent::run([n, Op]()->void
+    {
+        parFor(n, Op);
     });
 }
 
-void ThreadPool::parFor(size_t n, std::function<void (size_t)> Op)
+size_t ThreadPool::threadsNum()
+{
+    return Scheduler::instance().threadsNum();
+}
+
+size_t ThreadPool::grainSize(size_t n, int64_t ns, size_t nProbe)
+{
+    const int64_t inlineNs = s_inlineNs;
+    const int64_t taskNs = s_taskNs;
+    //Iteration cost is below clock resolution for empty probes
+    const int64_t itemNs = nProbe == 0 ? 1 : std::max<int64_t>(ns / static_cast<int64_t>(nProbe), 1);
+    if(n <= static_cast<size_t>(inlineNs / itemNs)) return n;
+    //Keep enough tasks for balancing of uneven loops
+    const size_t maxGrain = std::max<size_t>(n / (8 * threadsNum()), 1);
+    const size_t grain = static_cast<size_t>(std::max<int64_t>(taskNs / itemNs, 1));
+    return std::min(grain, maxGrain);
+}
+
+void ThreadPool::run(LoopBase &loop, size_t first, size_t last)
 {
-    parForAsync(n, Op).waitForFinished();
+    Scheduler::instance().execute(loop, first, last);
 }
@@ -2,17 +2,204 @@
 #define THREADPOOL_H
 
 #include <QtConcurrent>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <vector>
 
 /**
  * @brief The TreadPool class conteins static functions for thread
- * pool operation
+ * pool operation. Parallel loops are run by a work-stealing scheduler:
+ * every worker owns a deque of index ranges, it splits its range in halves
+ * and pushes the upper halves to its own deque where idle workers steal
+ * them from. The calling thread executes work too and sleeps when there is
+ * nothing to take, so loops may be nested and called from several threads
+ * at once. Workers are reserved in the global Qt pool, which keeps half of
+ * its maxThreadCount() but not less than two threads for load tasks and
+ * modal jobs, so both pools together do not exceed the cores. Workers sleep
+ * without work; code running in other threads sizes its own thread number
+ * by threadsNum() not to oversubscribe
  */
 class ThreadPool
 {
-    static QMutex s_mutex;
 public:
+    /**
+     * @brief parFor calls op(i) for i in [0, n) in parallel
+     * @param n number of iterations
+     * @param op loop body, it is called by reference and never copied
+     * @param grain the smallest range to be run as one task, zero means
+     * that grain is chosen from the measured cost of the first iterations
+     */
+    template<class Op>
+    static void parFor(size_t n, Op&& op, size_t grain = 0)
+    {
+        size_t first = 0;
+        if(grain == 0)
+        {
+            //Probe cost of iterations on the calling thread
+            using Clock = std::chrono::steady_clock;
+            const size_t maxProbe = s_maxProbeSize;
+            const size_t nProbe = n < maxProbe ? n : maxProbe;
+            const Clock::time_point start = Clock::now();
+            int64_t ns = 0;
+            while(first < nProbe && ns < s_probeNs)
+            {
+                op(first++);
+                ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                (
+                    Clock::now() - start
+                ).count();
+            }
+            grain = grainSize(n - first, ns, first);
+        }
+        if(n - first <= grain || threadsNum() == 1)
+        {
+            for(size_t i = first; i < n; ++i) op(i);
+            return;
+        }
+        Loop<typename std::remove_reference<Op>::type> loop(op, grain);
+        run(loop, first, n);
+    }
+
+    /**
+     * @brief parReduce folds map(i) for i in [0, n) with combine. Iterations
+     * are folded in blocks of fixed size and block results are combined in
+     * order of blocks, so the result is bitwise the same for any number of
+     * threads
+     * @param identity neutral element of combine
+     * @param map returns value of the i-th iteration
+     * @param combine associative operation
+     * @param blockSize number of iterations folded serially
+     */
+    template<class T, class Map, class Combine>
+    static T parReduce
+    (
+        size_t n,
+        const T& identity,
+        Map&& map,
+        Combine&& combine,
+        size_t blockSize = s_reduceBlockSize
+    )
+    {
+        const size_t nBlocks = (n + blockSize - 1) / blockSize;
+        std::vector<T> partial(nBlocks, identity);
+        parFor(nBlocks, [&](size_t b)
+        {
+            const size_t last = (b + 1) * blockSize < n ? (b + 1) * blockSize : n;
+            T acc = identity;
+            for(size_t i = b * blockSize; i < last; ++i) acc = combine(acc, map(i));
+            partial[b] = acc;
+        });
+        T res = identity;
+        for(const T& p : partial) res = combine(res, p);
+        return res;
+    }
+
+    /**
+     * @brief parInclusiveScan writes out[i] = in[0] op ... op in[i], output
+     * may coincide with input. Blocks are scanned in parallel after their
+     * offsets are found, the result does not depend on number of threads
+     * @param in random access input iterator
+     * @param n number of elements
+     * @param out random access output iterator
+     * @param op associative operation
+     * @param blockSize number of elements scanned serially
+     */
+    template<class InIt, class OutIt, class Op>
+    static void parInclusiveScan
+    (
+        InIt in,
+        size_t n,
+        OutIt out,
+        Op&& op,
+        size_t blockSize = s_reduceBlockSize
+    )
+    {
+        using T = typename std::iterator_traits<InIt>::value_type;
+        if(n == 0) return;
+        const size_t nBlocks = (n + blockSize - 1) / blockSize;
+        //Block totals, shifted to offsets of blocks by serial scan
+        std::vector<T> offsets(nBlocks);
+        parFor(nBlocks - 1, [&](size_t b)
+        {
+            const size_t first = b * blockSize;
+            T acc = in[first];
+            for(size_t i = first + 1; i < first + blockSize; ++i) acc = op(acc, in[i]);
+            offsets[b + 1] = acc;
+        });
+        for(size_t b = 2; b < nBlocks; ++b) offsets[b] = op(offsets[b - 1], offsets[b]);
+        parFor(nBlocks, [&](size_t b)
+        {
+            const size_t first = b * blockSize;
+            const size_t last = first + blockSize < n ? first + blockSize : n;
+            T acc = b == 0 ? in[first] : op(offsets[b], in[first]);
+            out[first] = acc;
+            for(size_t i = first + 1; i < last; ++i) out[i] = acc = op(acc, in[i]);
+        });
+    }
+
+    /**
+     * @brief parForAsync runs parFor in a Qt thread pool
+     */
     static QFuture<void> parForAsync(size_t n, std::function<void(size_t)> Op);
-    static void parFor(size_t n, std::function<void(size_t)> Op);
+
+    /**
+     * @brief threadsNum number of threads taking part in a parallel loop
+     */
+    static size_t threadsNum();
+
+    //Default number of iterations folded serially by reductions
+    static const size_t s_reduceBlockSize = 1024;
+
+private:
+    //Probing stops after this time or this number of iterations
+    static const int64_t s_probeNs = 2000;
+    static const size_t s_maxProbeSize = 64;
+    //Loops which take less time are run inline
+    static const int64_t s_inlineNs = 50000;
+    //Desired duration of a single task
+    static const int64_t s_taskNs = 20000;
+
+    class Scheduler;
+
+    class LoopBase
+    {
+    public:
+        explicit LoopBase(size_t grain) : mGrain(grain), mRemaining(0), mFailed(false) {}
+        virtual ~LoopBase() {}
+        virtual void run(size_t first, size_t last) = 0;
+
+        const size_t mGrain;
+        //Number of iterations which are not finished yet
+        std::atomic<size_t> mRemaining;
+        std::atomic<bool> mFailed;
+        std::exception_ptr mError;
+    };
+
+    template<class Op>
+    class Loop : public LoopBase
+    {
+        Op& mOp;
+    public:
+        Loop(Op& op, size_t grain) : LoopBase(grain), mOp(op) {}
+        void run(size_t first, size_t last) override
+        {
+            for(size_t i = first; i < last; ++i) mOp(i);
+        }
+    };
+
+    /**
+     * @brief grainSize chooses grain for n iterations if nProbe iterations
+     * took ns nanoseconds, returns n if the loop should be run inline
+     */
+    static size_t grainSize(size_t n, int64_t ns, size_t nProbe);
+
+    /**
+     * @brief run executes iterations [first, last) of the loop and returns
+     * when all of them are finished, rethrows the first exception of a body
+     */
+    static void run(LoopBase& loop, size_t first, size_t last);
 };
 
 #endif // THREADPOOL_H
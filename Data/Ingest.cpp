@@ -0,0 +1,101 @@
+#include "Ingest.h"
+#include "TimeEvents.h"
+#include "MassSpecBuilder.h"
+#include "Base/Job.h"
+#include <QThread>
+#include <algorithm>
+#include <limits>
+
+Ingest::Ingest(TimeEvents *timeEvents, MassSpectrumsCollection *massSpecColl)
+    :
+      mTimeEvents(timeEvents),
+      mMassSpecColl(massSpecColl),
+      mJob(nullptr)
+{
+    //Histogram and compress stages share cores with each other and with
+    //workers of ThreadPool, so each stage takes half of them
+    const size_t nWorkers = static_cast<size_t>(std::max(QThread::idealThreadCount() / 2, 1));
+
+    mPipeline.addOrderedStage("slice", [this](Item& in, const Pipeline<Item>::Emit& emit)
+    {
+        if(isCancelled()) return;
+        const QList<TimeEventsContainer> slices
+                = mTimeEvents->blockingAddEvents(in.evts, in.last);
+        MassSpectrumsCollection::StorePtr s = mMassSpecColl->store();
+        for(const TimeEventsContainer& slice : slices)
+        {
+            Item out = item(slice, false);
+            out.store = s;
+            emit(std::move(out));
+        }
+    });
+
+    mPipeline.addStage("histogram", nWorkers, [this](Item& it)
+    {
+        if(isCancelled()) return;
+        //Histogram buffer is reused by the stage thread
+        static thread_local MassSpecBuilder builder;
+        it.ms = builder.build(it.evts, it.store->arena(), mMassSpecColl->msType());
+        const MassSpecImpl::Vec& hist = builder.hist();
+        it.counts.hist.assign(hist.begin(), hist.end());
+        it.counts.first = builder.histFirst();
+        it.counts.tic = builder.tic();
+        it.evts.clear();
+        if(it.ms && !it.ms->isEmpty())
+        {
+            it.minBin = it.ms->first().first;
+            it.maxBin = it.ms->last().first;
+        }
+    });
+
+    mPipeline.addStage("compress", nWorkers, [](Item& it)
+    {
+        if(it.ms) it.ms->pack();
+    });
+
+    mPipeline.addOrderedStage("commit", [this](Item& it, const Pipeline<Item>::Emit&)
+    {
+        mMassSpecColl->blockingPublish(it.store, it.ms, it.counts, it.minBin, it.maxBin);
+    });
+}
+
+void Ingest::begin()
+{
+    mJob = Job::current();
+    mPipeline.start();
+}
+
+void Ingest::push(const TimeEventsContainer &evts)
+{
+    mPipeline.push(item(evts, false));
+}
+
+void Ingest::end()
+{
+    mPipeline.push(item(TimeEventsContainer(), true));
+    mPipeline.finish();
+    //Sums since the start of the next block of data take O(bins) time
+    if(!isCancelled()) mMassSpecColl->checkpoint();
+}
+
+std::vector<Ingest::Stats> Ingest::stats() const
+{
+    return mPipeline.stats();
+}
+
+bool Ingest::isCancelled() const
+{
+    return mJob && mJob->isCancelled();
+}
+
+Ingest::Item Ingest::item(const TimeEventsContainer &evts, bool last)
+{
+    Item res;
+    res.evts = evts;
+    res.last = last;
+    res.ms = nullptr;
+    res.counts = MassSpecStore::Counts{std::vector<int64_t>(), 0, 0};
+    res.minBin = std::numeric_limits<int>::max();
+    res.maxBin = std::numeric_limits<int>::min();
+    return res;
+}
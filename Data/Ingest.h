@@ -0,0 +1,76 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "Base/Pipeline.h"
+#include "Data/MassSpec.h"
+
+class TimeEvents;
+class Job;
+
+/**
+ * @brief The Ingest class turns blocks of read time events into published
+ * mass spectra. Stages are connected by bounded queues, so a fast reader
+ * waits for the slowest stage instead of piling events up in memory:
+ * slice (ordered) cuts blocks into time slices by startsPerHist,
+ * histogram and compress share all cores, commit (ordered) publishes
+ * spectra in order of time slices. Items of a cancelled job pass the
+ * stages without work, so the pipeline drains at once
+ */
+class Ingest
+{
+public:
+    struct Item
+    {
+        TimeEventsContainer evts;
+        //The last block of data
+        bool last;
+        //Store for which mass spectrum is made
+        MassSpectrumsCollection::StorePtr store;
+        MassSpecImpl * ms;
+        //Counts taken by histogram stage, they feed running total on commit
+        MassSpecStore::Counts counts;
+        int minBin;
+        int maxBin;
+    };
+
+    using Stats = Pipeline<Item>::StageStats;
+
+    Ingest(TimeEvents * timeEvents, MassSpectrumsCollection * massSpecColl);
+
+    /**
+     * @brief begin starts stage threads for the current job of calling thread
+     */
+    void begin();
+
+    /**
+     * @brief push passes block of events read, waits while the pipeline is full.
+     * After a stage has failed blocks are dropped and end rethrows the error
+     * @param evts
+     */
+    void push(const TimeEventsContainer& evts);
+
+    /**
+     * @brief end flushes incomplete time slice, waits until all spectra are
+     * published, stops stage threads and makes checkpoint of the collection
+     */
+    void end();
+
+    /**
+     * @brief stats per stage throughput and queue occupancy of the current
+     * or the last run
+     * @return
+     */
+    std::vector<Stats> stats() const;
+
+private:
+    TimeEvents * mTimeEvents;
+    MassSpectrumsCollection * mMassSpecColl;
+    Pipeline<Item> mPipeline;
+    const Job * mJob;
+
+    bool isCancelled() const;
+
+    static Item item(const TimeEventsContainer& evts, bool last);
+};
+
+#endif // INGEST_H
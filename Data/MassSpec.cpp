@@ -1,6 +1,8 @@
 #include "Base/BaseObject.h"
 #include "MassSpec.h"
+#include "Base/ThreadPool.h"
 #include <QtConcurrent>
+#include <QElapsedTimer>
 #include <QMessageBox>
 
 MassSpec::MassSpec(QObject *parent)
@@ -99,12 +101,7 @@ void MassSpec::blockingAddMassSpec(const MapUintUint &ms)
 MapUintUint MassSpec::getMassSpec(size_t First, size_t Last) const
 {
     Q_ASSERT(First < Last && Last <= mData.size());
-    MapUintUint res;
-    for(; First < Last; ++First)
-    {
-        mSummator->add(res, mData[First]);
-    }
-    return res;
+    return mSummator->sum(mData, First, Last);
 }
 
 MapUintUint MassSpec::blockingGetMassSpec(size_t First, size_t Last)
@@ -147,19 +144,18 @@ double MassSpec::blockingGetMassSpecTotalCurrent(size_t idx)
 MassSpec::VectorUint MassSpec::getIonCurrent(Uint First, Uint Last) const
 {
     VectorUint res(mData.size());
-    size_t i = 0;
-    for(const MapUintUint& currHist : mData)
+    ThreadPool::parFor(mData.size(), [&](size_t i)
     {
         MapUintUint::const_iterator
-                it1 = currHist.lower_bound(First),
-                it2 = currHist.upper_bound(Last);
+                it1 = mData[i].lower_bound(First),
+                it2 = mData[i].upper_bound(Last);
         size_t TIC = 0;
         for(;it1 != it2; ++it1)
         {
             TIC += it1->second;
         }
-        res[i++] = TIC;
-    }
+        res[i] = TIC;
+    });
     return res;
 }
 
@@ -235,12 +231,42 @@ MassSpec::Locker MassSpec::lockInstance()
 }
 
 
+namespace
+{
+/**
+ * @brief The TimedLocker class locks mutex and adds waiting time to the counter
+ */
+class TimedLocker
+{
+    QMutex& mMutex;
+public:
+    TimedLocker(QMutex& mutex, std::atomic<qint64>& waitNs)
+        :
+          mMutex(mutex)
+    {
+        if(!mMutex.tryLock())
+        {
+            QElapsedTimer timer;
+            timer.start();
+            mMutex.lock();
+            waitNs += timer.nsecsElapsed();
+        }
+    }
+    ~TimedLocker()
+    {
+        mMutex.unlock();
+    }
+};
+}
+
 MassSpectrumsCollection::MassSpectrumsCollection(QObject *parent)
     :
       QObject(parent),
-      mMsType(MassSpecImpl::MassSpecMapType),
-      nMaxBin(std::numeric_limits<int>::min()),
-      nMinBin(std::numeric_limits<int>::max())
+      mStore(new MassSpecStore),
+      mMsType(MassSpecImpl::MassSpecAutoType),
+      mCacheBudget(MassSpecCache::s_defaultBudget),
+      mStorage(PackArena::MemoryStorage),
+      mLockWaitNs(0)
 {
     qRegisterMetaType<MassSpecType>("MassSpecType");
     qRegisterMetaType<VecInt>("VecInt");
@@ -264,53 +290,98 @@ void MassSpectrumsCollection::setFileName(const QString &fileName)
     Q_EMIT fileNameNotify(fileName);
 }
 
+MassSpectrumsCollection::StorePtr MassSpectrumsCollection::store() const
+{
+    return std::atomic_load(&mStore);
+}
+
 MassSpecImpl::MapShrdPtr MassSpectrumsCollection::massSpec(size_t idx)
 {
-    return mCollection[idx]->data();
+    return store()->massSpec(idx);
 }
 
 MassSpecImpl::MapShrdPtr MassSpectrumsCollection::blockingMassSpec(size_t idx)
 {
-    QMutexLocker lock(&mMut);
     return massSpec(idx);
 }
 
 void MassSpectrumsCollection::unpackByMask(const std::vector<bool> &mask)
 {
-    for(size_t i = 0; i != mask.size() && i != mCollection.size(); ++i)
+    StorePtr s = store();
+    for(size_t i = 0; i != mask.size() && i != s->size(); ++i)
     {
-        if(mask[i]) mCollection[i]->unpack();
+        if(mask[i]) s->massSpec(i);
     }
 }
 
 void MassSpectrumsCollection::blockingUnpackByMask(const std::vector<bool> &mask)
 {
-    QMutexLocker lock(&mMut);
     unpackByMask(mask);
 }
 
 size_t MassSpectrumsCollection::size() const
 {
-    return mCollection.size();
+    return store()->size();
 }
 
 size_t MassSpectrumsCollection::blockingSize()
 {
-    QMutexLocker lock(&mMut);
     return size();
 }
 
+size_t MassSpectrumsCollection::cacheBudget() const
+{
+    return mCacheBudget;
+}
+
+void MassSpectrumsCollection::setCacheBudget(size_t bytes)
+{
+    mCacheBudget = bytes;
+    store()->cache()->setBudget(bytes);
+}
+
+size_t MassSpectrumsCollection::cacheHits() const
+{
+    return store()->cache()->hits();
+}
+
+size_t MassSpectrumsCollection::cacheMisses() const
+{
+    return store()->cache()->misses();
+}
+
+size_t MassSpectrumsCollection::checkpoint()
+{
+    return store()->checkpoint();
+}
+
+qint64 MassSpectrumsCollection::lockWaitTime() const
+{
+    return mLockWaitNs;
+}
+
 void MassSpectrumsCollection::clear()
 {
-    for(MassSpecImpl * ms : mCollection)
-        MassSpecImpl::release(ms);
-    mCollection.clear();
+    //Spectra being packed into the old store are dropped
+    for(const std::shared_ptr<Pending>& p : mPending)
+    {
+        p->done.waitForFinished();
+        for(MassSpecImpl * ms : p->ms) MassSpecImpl::release(ms);
+    }
+    mPending.clear();
+    mBatch.clear();
+    //Old spectra are freed when the last reader releases them
+    std::atomic_store
+    (
+        &mStore,
+        StorePtr(new MassSpecStore(mStorage, mCacheBudget))
+    );
     Q_EMIT cleared();
 }
 
 void MassSpectrumsCollection::blockingClear()
 {
-    QMutexLocker lock(&mMut);
+    TimedLocker lock(mMut, mLockWaitNs);
     clear();
 }
 
@@ -318,120 +389,233 @@ void MassSpectrumsCollection::addMassSpec(const MapIntInt &ms)
 {
     if(!ms.empty())
     {
-        mCollection.push_back(MassSpecImpl::create(mMsType, ms));
-        Q_EMIT massSpecNumNotify(mCollection.size());
-        checkLastTimeLimsAndNotify();
-        mCollection.back()->pack();
+        const MassSpecType type = mMsType;
+        enqueue([=](PackArena * arena)->MassSpecImpl*
+        {
+            return MassSpecImpl::create(type, ms, arena);
+        });
     }
 }
 
 void MassSpectrumsCollection::blockingAddMassSpec(const MapIntInt &ms)
 {
-    QMutexLocker lock(&mMut);
+    TimedLocker lock(mMut, mLockWaitNs);
     addMassSpec(ms);
 }
 
 void MassSpectrumsCollection::addMassSpec(TimeEventsContainer evts)
 {
-    if
-    (
-        evts.empty()
-        || std::all_of(evts.begin(), evts.end(),
-                       [](TimeEventsContainer::const_reference evt)->bool{ return evt == 0; })
-    ) return;
-    else
+    const MassSpecType type = mMsType;
+    enqueue([=](PackArena * arena)->MassSpecImpl*
     {
-        mCollection.push_back(MassSpecImpl::create(mMsType, VecInt()));
-        for(TimeEvent evt : evts)
-        {
-            mCollection.back()->addEvent(static_cast<int>(evt));
-        }
-        checkLastTimeLimsAndNotify();
-        mCollection.back()->pack();
-    }
-    Q_EMIT massSpecNumNotify(mCollection.size());
+        //Histogram buffer is reused by the worker thread
+        static thread_local MassSpecBuilder builder;
+        return builder.build(evts, arena, type);
+    });
 }
 
 void MassSpectrumsCollection::blockingAddMassSpec(TimeEventsContainer evts)
 {
-    QMutexLocker lock(&mMut);
+    TimedLocker lock(mMut, mLockWaitNs);
     addMassSpec(evts);
 }
 
 void MassSpectrumsCollection::addMassSpec(const VecInt &ms)
 {
-    mCollection.push_back(MassSpecImpl::create(mMsType, ms));
-    checkLastTimeLimsAndNotify();
-    Q_EMIT massSpecNumNotify(mCollection.size());
-    mCollection.back()->pack();
+    const MassSpecType type = mMsType;
+    enqueue([=](PackArena * arena)->MassSpecImpl*
+    {
+        return MassSpecImpl::create(type, ms, arena);
+    });
 }
 
 void MassSpectrumsCollection::blockingAddMassSpec(const VecInt &ms)
 {
-    QMutexLocker lock(&mMut);
+    TimedLocker lock(mMut, mLockWaitNs);
     addMassSpec(ms);
 }
 
-void MassSpectrumsCollection::packAll()
+void MassSpectrumsCollection::enqueue(Make make)
+{
+    mBatch.push_back(std::move(make));
+    //Spectra are batched only while all threads are busy
+    const size_t nThreads = ThreadPool::threadsNum();
+    if(mPending.size() < nThreads || mBatch.size() >= s_batchSize)
+    {
+        //Writer waits for the oldest batch when too many are in flight
+        while(mPending.size() >= s_maxPendingPerThread * nThreads)
+        {
+            mPending.front()->done.waitForFinished();
+            commit();
+        }
+        startBatch();
+    }
+}
+
+void MassSpectrumsCollection::startBatch()
 {
-    for(MassSpecImpl * ptr : mCollection)
-        ptr->pack();
+    if(mBatch.empty()) return;
+    std::shared_ptr<Pending> p(new Pending);
+    p->ready = false;
+    p->minBin = std::numeric_limits<int>::max();
+    p->maxBin = std::numeric_limits<int>::min();
+    p->store = store();
+    PackArena * arena = p->store->arena();
+    std::shared_ptr<std::vector<Make>> batch(new std::vector<Make>);
+    batch->swap(mBatch);
+    p->done = QtConcurrent::run([this, p, arena, batch]()
+    {
+        //Spectra are made and packed without collection lock
+        p->ms.reserve(batch->size());
+        p->counts.reserve(batch->size());
+        for(const Make& make : *batch)
+        {
+            MassSpecImpl * ms = make(arena);
+            if(!ms) continue;
+            if(!ms->isEmpty())
+            {
+                p->minBin = std::min(p->minBin, ms->first().first);
+                p->maxBin = std::max(p->maxBin, ms->last().first);
+            }
+            p->counts.push_back(MassSpecStore::counts(*ms));
+            ms->pack();
+            p->ms.push_back(ms);
+        }
+        p->ready = true;
+        QMetaObject::invokeMethod(this, "commitReady", Qt::QueuedConnection);
+    });
+    mPending.push_back(p);
 }
 
-void MassSpectrumsCollection::blockingPackAll()
+void MassSpectrumsCollection::flush()
 {
-    QMutexLocker lock(&mMut);
-    packAll();
+    startBatch();
+    for(const std::shared_ptr<Pending>& p : mPending)
+        p->done.waitForFinished();
+    commit();
 }
 
-void MassSpectrumsCollection::checkLastTimeLimsAndNotify()
+void MassSpectrumsCollection::commit()
 {
-    if(!(mCollection.back()->isPacked() || mCollection.back()->isEmpty()))
+    //Ready spectra are published in the order they were added
+    StorePtr s = store();
+    const size_t n = s->size();
+    bool limitsChanged = false;
+    while(!mPending.empty() && mPending.front()->ready)
     {
-        bool notify = false;
-        MapIntInt::value_type
-                f = mCollection.back()->first(),
-                l = mCollection.back()->last();
-        if(nMinBin > f.first)
+        const std::shared_ptr<Pending>& p = mPending.front();
+        if(p->store == s)
         {
-            nMinBin = f.first;
-            notify = true;
+            //Limits are published first, so readers never meet a spectrum
+            //outside of them
+            limitsChanged |= s->updateLimits(p->minBin, p->maxBin);
+            for(size_t i = 0; i < p->ms.size(); ++i) s->push(p->ms[i], p->counts[i]);
         }
-        if(nMaxBin < l.first)
+        else
         {
-            nMaxBin = l.first;
-            notify = true;
+            for(MassSpecImpl * ms : p->ms) MassSpecImpl::release(ms);
         }
-        if(notify)
-            Q_EMIT timeLimitsNotify(nMinBin, nMaxBin);
+        mPending.pop_front();
     }
+    //Spectra batched while threads were busy are started when they free
+    if(mPending.size() < ThreadPool::threadsNum()) startBatch();
+    if(limitsChanged)
+        Q_EMIT timeLimitsNotify(s->minBin(), s->maxBin());
+    if(n != s->size())
+        Q_EMIT massSpecNumNotify(s->size());
+}
+
+void MassSpectrumsCollection::blockingPublish
+(
+    const StorePtr &s,
+    MassSpecImpl *ms,
+    const MassSpecStore::Counts &counts,
+    int minBin,
+    int maxBin
+)
+{
+    TimedLocker lock(mMut, mLockWaitNs);
+    //Spectra added before are published first
+    commit();
+    if(!ms) return;
+    if(s != store())
+    {
+        MassSpecImpl::release(ms);
+        return;
+    }
+    const bool limitsChanged = s->updateLimits(minBin, maxBin);
+    s->push(ms, counts);
+    if(limitsChanged)
+        Q_EMIT timeLimitsNotify(s->minBin(), s->maxBin());
+    Q_EMIT massSpecNumNotify(s->size());
+}
+
+void MassSpectrumsCollection::commitReady()
+{
+    TimedLocker lock(mMut, mLockWaitNs);
+    commit();
 }
 
 MassSpecType MassSpectrumsCollection::msType()
 {
-    QMutexLocker lock(&mMut);
     return mMsType;
 }
 
+PackArena::Storage MassSpectrumsCollection::storage()
+{
+    return store()->arena()->storage();
+}
+
+void MassSpectrumsCollection::setStorage(PackArena::Storage storage)
+{
+    mStorage = storage;
+}
+
+void MassSpectrumsCollection::repack(PackArena::Storage storage)
+{
+    //Converted spectra are published with a new store, readers keep
+    //the old one while they use it
+    StorePtr cur = store();
+    StorePtr res(new MassSpecStore(storage, mCacheBudget));
+    const MassSpecType type = mMsType;
+    const size_t n = cur->size();
+    res->updateLimits(cur->minBin(), cur->maxBin());
+    //Spectra are converted by chunks and published in order
+    const size_t chunk = MassSpecStore::s_chunkSize;
+    std::vector<MassSpecImpl*> converted(chunk);
+    for(size_t first = 0; first < n; first += chunk)
+    {
+        const size_t m = std::min(n - first, chunk);
+        ThreadPool::parFor(m, [&](size_t i)
+        {
+            converted[i] = MassSpecImpl::create(type, *cur->at(first + i)->data(), res->arena());
+            converted[i]->pack();
+        });
+        //Totals are taken from the current store at once
+        for(size_t i = 0; i < m; ++i)
+            res->push(converted[i], MassSpecStore::Counts{std::vector<int64_t>(), 0, cur->tic(first + i)});
+    }
+    res->copyTotals(*cur);
+    std::atomic_store(&mStore, res);
+}
+
 VecInt MassSpectrumsCollection::readTotalIonCurrent
 (
     int idxFirst,
     int idxLast
 )
 {
-    QMutexLocker lock(&mMut);
+    StorePtr s = store();
     VecInt res;
-    idxLast = idxLast <= mCollection.size() ? idxLast : mCollection.size();
-    if(idxFirst < idxLast)
+    if(idxLast <= 0) return res;
+    const size_t first = static_cast<size_t>(std::max(idxFirst, 0));
+    const size_t last = std::min(static_cast<size_t>(idxLast), s->size());
+    if(first < last)
     {
-        res.assign(idxLast - idxFirst, 0);
-        for(size_t i = 0; idxFirst < idxLast; ++idxFirst, ++i)
+        res.assign(last - first, 0);
+        for(size_t i = first; i < last; ++i)
         {
-            mCollection[idxFirst]->unpack();
-            MassSpecImpl::Map::value_type _First = mCollection[idxFirst]->first();
-            MassSpecImpl::Map::value_type _Last = mCollection[idxFirst]->last();
-            res[i] = mCollection[idxFirst]->tic(_First.first, _Last.first);
-            mCollection[idxFirst]->pack();
+            res[i - first] = s->tic(i);
         }
     }
     return res;
@@ -439,24 +623,18 @@ VecInt MassSpectrumsCollection::readTotalIonCurrent
 
 void MassSpectrumsCollection::setMsType(const MassSpecType &msType)
 {
-    QMutexLocker lock(&mMut);
+    TimedLocker lock(mMut, mLockWaitNs);
+    flush();
     mMsType = msType;
-    for(size_t i = 0; i < mCollection.size(); ++i)
-    {
-        MassSpecImpl::MapShrdPtr ms = mCollection[i]->data();
-        MassSpecImpl::release(mCollection[i]);
-        mCollection[i] = MassSpecImpl::create(mMsType, *ms);
-    }
+    repack(store()->arena()->storage());
 }
 
 int MassSpectrumsCollection::minBin()
 {
-    QMutexLocker lock(&mMut);
-    return nMinBin;
+    return store()->minBin();
 }
 
 int MassSpectrumsCollection::maxBin()
 {
-    QMutexLocker lock(&mMut);
-    return nMaxBin;
+    return store()->maxBin();
 }
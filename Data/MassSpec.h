@@ -2,12 +2,18 @@
 #define MASSSPEC_H
 
 #include <QObject>
+#include <QFuture>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <QMutex>
 
 #include "Math/MassSpecSummator.h"
 #include "TimeEvents.h"
 #include "MassSpecImpl.h"
+#include "MassSpecStore.h"
+#include "MassSpecBuilder.h"
 
 using Uint = unsigned long long;
 using MapUintUint = std::map<Uint, Uint>;
@@ -15,10 +21,17 @@ using MapIntInt = std::map<int, int>;
 using VecInt = std::vector<int>;
 using MassSpecType = MassSpecImpl::Type;
 
+/**
+ * @brief The MassSpectrumsCollection class keeps mass spectra of the data file.
+ * Readers work with the snapshot of the current store and never lock,
+ * writers are serialized by the collection mutex
+ */
 class MassSpectrumsCollection : public QObject
 {
     Q_OBJECT
 public:
+    using StorePtr = std::shared_ptr<MassSpecStore>;
+
     Q_PROPERTY(QString fileName READ fileName WRITE setFileName NOTIFY fileNameNotify)
     Q_PROPERTY(int maxBin READ maxBin)
     Q_PROPERTY(int minBin READ minBin)
@@ -31,7 +44,15 @@ public:
     void setFileName(const QString &fileName);
 
     /**
-     * @brief massSpec returns mass spectrum by idx
+     * @brief store returns snapshot of published mass spectra. It stays valid
+     * after clear or conversion of the collection
+     * @return
+     */
+    StorePtr store() const;
+
+    /**
+     * @brief massSpec returns mass spectrum by idx. Decoded mass spectra are
+     * kept in LRU cache, so repeated requests do not unpack data again
      * @param idx
      * @return
      */
@@ -45,7 +66,7 @@ public:
         return blockingMassSpec(static_cast<size_t>(n));
     }
     /**
-     * @brief unpackByMask unpacks all mass spectra for which mask[idx] is true value
+     * @brief unpackByMask decodes into cache all mass spectra for which mask[idx] is true value
      * @param mask
      */
     void unpackByMask(const std::vector<bool>& mask);
@@ -61,9 +82,63 @@ public:
         return static_cast<_Number>(n);
     }
 
+    /**
+     * @brief cacheBudget max number of bytes occupied by decoded mass spectra
+     * @return
+     */
+    size_t cacheBudget() const;
+    void setCacheBudget(size_t bytes);
+    size_t cacheHits() const;
+    size_t cacheMisses() const;
+
+    /**
+     * @brief checkpoint saves running total spectrum of current mass spectra,
+     * sums starting from the checkpoint take O(bins) time. Ingest makes it
+     * after each read file
+     * @return number of mass spectra in the checkpoint
+     */
+    size_t checkpoint();
+
+    /**
+     * @brief blockingPublish adds mass spectrum which was made and packed
+     * outside of the collection for the store snapshot s. Spectra made for
+     * a replaced store are released
+     * @param s
+     * @param ms
+     * @param counts counts of ms taken before packing
+     * @param minBin
+     * @param maxBin
+     */
+    void blockingPublish
+    (
+        const StorePtr& s,
+        MassSpecImpl * ms,
+        const MassSpecStore::Counts& counts,
+        int minBin,
+        int maxBin
+    );
+
+    /**
+     * @brief lockWaitTime total time writers waited for collection lock
+     * @return nanoseconds
+     */
+    qint64 lockWaitTime() const;
+
     int maxBin();
     int minBin();
+    /**
+     * @brief msType storage type of new mass spectra, MassSpecAutoType
+     * (default) chooses it for each spectrum by occupancy of its bins
+     * @return
+     */
     MassSpecType msType();
+    /**
+     * @brief storage tells where packed mass spectra are kept. For the
+     * MappedFileStorage only indexes are resident and packed data is paged in
+     * from the scratch file on demand
+     * @return
+     */
+    PackArena::Storage storage();
     VecInt readTotalIonCurrent(int idxFirst, int idxLast);
 Q_SIGNALS:
     void cleared();
@@ -74,6 +149,9 @@ Q_SIGNALS:
 
 public Q_SLOTS:
     void setMsType(const MassSpecType &msType);
+    //Storage of the next data, it is applied by clear, so spectra which
+    //are about to be dropped are never repacked
+    void setStorage(PackArena::Storage storage);
     void clear();
     void blockingClear();
     void addMassSpec(const MapIntInt& ms);
@@ -82,19 +160,63 @@ public Q_SLOTS:
     void blockingAddMassSpec(TimeEventsContainer evts);
     void addMassSpec(const VecInt& ms);
     void blockingAddMassSpec(const VecInt& ms);
-    void packAll();
-    void blockingPackAll();
 private:
-    void checkLastTimeLimsAndNotify();
+    using Make = std::function<MassSpecImpl*(PackArena*)>;
+
+    //Max number of mass spectra made by one task
+    static const size_t s_batchSize = 64;
+    //Max number of tasks in flight per thread before writer waits
+    static const size_t s_maxPendingPerThread = 2;
+
+    /**
+     * @brief The Pending struct is a batch of mass spectra which are being
+     * made and packed in worker thread
+     */
+    struct Pending
+    {
+        QFuture<void> done;
+        //Store for which mass spectra are packed
+        StorePtr store;
+        std::atomic<bool> ready;
+        std::vector<MassSpecImpl*> ms;
+        std::vector<MassSpecStore::Counts> counts;
+        //Limits of all spectra of the batch
+        int minBin;
+        int maxBin;
+    };
+
+    Q_SLOT void commitReady();
+    /**
+     * @brief enqueue runs make and packing of its result in worker thread.
+     * Results are added to collection in the order of enqueue calls. While
+     * all threads are busy calls are batched, and the caller waits when
+     * too many batches are in flight
+     * @param make creates mass spectrum in supplied arena
+     */
+    void enqueue(Make make);
+    //Starts task for the batched calls of enqueue
+    void startBatch();
+    //Waits for all pending mass spectra and adds them
+    void flush();
+    //Adds pending mass spectra which are ready
+    void commit();
+    //Recreates all mass spectra in a new arena using current mass spec type
+    void repack(PackArena::Storage storage);
     QString mFileName;
-    std::vector<MassSpecImpl*> mCollection;
-    MassSpecType mMsType;
+    //Published mass spectra, replaced as a whole by clear and conversions.
+    //Accessed only by std::atomic_load and std::atomic_store
+    StorePtr mStore;
+    //Mass spectra being packed, in order of addition
+    std::deque<std::shared_ptr<Pending>> mPending;
+    //Calls of enqueue not started yet
+    std::vector<Make> mBatch;
+    std::atomic<MassSpecType> mMsType;
+    std::atomic<size_t> mCacheBudget;
+    //Storage of the store made by the next clear
+    std::atomic<PackArena::Storage> mStorage;
+    //Serializes writers only
     QMutex mMut;
-    //Max and min time through all mass spectra
-    volatile int nMaxBin;
-    volatile int nMinBin;
-    friend class MSSum;
-    friend class DirectSum;
+    std::atomic<qint64> mLockWaitNs;
 };
 
 class MassSpec : public QObject
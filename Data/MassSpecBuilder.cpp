@@ -0,0 +1,115 @@
+#include "MassSpecBuilder.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+MassSpecBuilder::MassSpecBuilder()
+    :
+      mHistFirst(0),
+      mTic(0)
+{
+
+}
+
+MassSpecImpl *MassSpecBuilder::build
+(
+    const TimeEventsContainer &evts,
+    PackArena *arena,
+    MassSpecImpl::Type type
+)
+{
+    mTic = 0;
+    mHist.clear();
+    TimeEvent minEvt = std::numeric_limits<TimeEvent>::max(), maxEvt = 0;
+    for(TimeEvent evt : evts)
+    {
+        //Zero start events do not change limits
+        const TimeEvent t = evt == 0 ? minEvt : evt;
+        minEvt = std::min(minEvt, t);
+        maxEvt = std::max(maxEvt, evt);
+    }
+    if(maxEvt == 0) return nullptr;
+    if(maxEvt >= static_cast<TimeEvent>(std::numeric_limits<int>::max()))
+        throw std::runtime_error("Time event is out of mass spectrum range!");
+
+    //Bin 0 collects start events and is cleared after counting, so both
+    //edge bins are zero neighbours of the first and last filled bins
+    const size_t n = static_cast<size_t>(maxEvt - minEvt) + 3;
+    const TimeEvent origin = minEvt - 1;
+    mHist.assign(s_subHistsNum * n, 0);
+    int * h = mHist.data();
+    TimeEventsContainer::const_iterator it = evts.cbegin(), _End = evts.cend();
+    for(int i = evts.size() / s_subHistsNum; i != 0; --i)
+    {
+        for(size_t k = 0; k < s_subHistsNum; ++k, ++it)
+        {
+            const TimeEvent evt = *it;
+            h[k * n + (evt == 0 ? 0 : evt - origin)]++;
+        }
+    }
+    for(; it != _End; ++it)
+    {
+        h[*it == 0 ? 0 : *it - origin]++;
+    }
+    for(size_t k = 1; k < s_subHistsNum; ++k)
+    {
+        const int * hk = h + k * n;
+        for(size_t i = 0; i < n; ++i) h[i] += hk[i];
+    }
+    h[0] = 0;
+    mHist.resize(n);
+
+    size_t nFilled = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        nFilled += h[i] != 0;
+        mTic += h[i];
+    }
+
+    const int timeZero = static_cast<int>(origin);
+    mHistFirst = timeZero;
+    const bool dense = type == MassSpecImpl::MassSpecAutoType ?
+                isDense(n, nFilled) : type == MassSpecImpl::MassSpecVecType;
+    if(dense)
+    {
+        MassSpecVec * ms = new MassSpecVec(MassSpecImpl::Vec(), false, arena);
+        ms->mData.assign(mHist.begin(), mHist.end());
+        ms->nTimeZero = timeZero;
+        return ms;
+    }
+
+    MassSpecMap * ms = new MassSpecMap(MassSpecImpl::Map(), false, arena);
+    MassSpecImpl::Map& data = ms->mData;
+    for(size_t i = 1; i + 1 < n; ++i)
+    {
+        if((h[i - 1] | h[i] | h[i + 1]) != 0)
+        {
+            data.emplace_hint(data.end(), timeZero + static_cast<int>(i), h[i]);
+        }
+    }
+    //Zero neighbours of the first and the last filled bins
+    data.emplace_hint(data.begin(), timeZero, 0);
+    data.emplace_hint(data.end(), timeZero + static_cast<int>(n) - 1, 0);
+    return ms;
+}
+
+int MassSpecBuilder::tic() const
+{
+    return mTic;
+}
+
+const MassSpecImpl::Vec &MassSpecBuilder::hist() const
+{
+    return mHist;
+}
+
+int MassSpecBuilder::histFirst() const
+{
+    return mHistFirst;
+}
+
+bool MassSpecBuilder::isDense(size_t nBins, size_t nFilled)
+{
+    //Each filled bin in sparse storage takes up to three map entries
+    return nBins * sizeof(int) <= 3 * nFilled * sizeof(MassSpecImpl::Map::value_type);
+}
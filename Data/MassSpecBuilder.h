@@ -0,0 +1,66 @@
+#ifndef MASSSPECBUILDER_H
+#define MASSSPECBUILDER_H
+
+#include "TimeEvents.h"
+#include "MassSpecImpl.h"
+
+/**
+ * @brief The MassSpecBuilder class makes mass spectrum from a slice of time
+ * events in linear time. Events are counted into interleaved sub-histograms,
+ * so neighbouring events never update the same counter. Storage type is
+ * the requested one, for MassSpecAutoType it is chosen by the occupancy of
+ * the time range
+ */
+class MassSpecBuilder
+{
+public:
+    //Number of interleaved sub-histograms
+    static const size_t s_subHistsNum = 4;
+
+    MassSpecBuilder();
+
+    /**
+     * @brief build creates unpacked mass spectrum from time events.
+     * Zero events are start events and are skipped
+     * @param evts
+     * @param arena arena to keep packed data of created mass spectrum
+     * @param type storage type of created mass spectrum
+     * @return nullptr if there are no events except start ones
+     */
+    MassSpecImpl * build
+    (
+        const TimeEventsContainer& evts,
+        PackArena * arena,
+        MassSpecImpl::Type type = MassSpecImpl::MassSpecAutoType
+    );
+
+    /**
+     * @brief isDense tells if dense storage is smaller than sparse one
+     * @param nBins number of bins in time range
+     * @param nFilled number of nonzero bins
+     * @return
+     */
+    static bool isDense(size_t nBins, size_t nFilled);
+
+    /**
+     * @brief tic total ion current of the last built mass spectrum, it is
+     * counted on the histogram, so packed spectrum needs no decoding
+     * @return
+     */
+    int tic() const;
+
+    /**
+     * @brief hist dense histogram of the last built mass spectrum, hist()[i]
+     * is intensity of the bin histFirst() + i
+     */
+    const MassSpecImpl::Vec& hist() const;
+    int histFirst() const;
+
+private:
+    //Reused between calls not to allocate memory for each slice
+    MassSpecImpl::Vec mHist;
+    int mHistFirst;
+    int mTic;
+};
+
+#endif // MASSSPECBUILDER_H
@@ -0,0 +1,90 @@
+#include "MassSpecCache.h"
+
+MassSpecCache::MassSpecCache(size_t budget)
+    :
+      mBudget(budget),
+      mBytes(0),
+      mHits(0),
+      mMisses(0)
+{
+
+}
+
+MassSpecCache::MapShrdPtr MassSpecCache::find(size_t idx)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mIndex.find(idx);
+    if(it == mIndex.end())
+    {
+        mMisses++;
+        return MapShrdPtr();
+    }
+    mLru.splice(mLru.begin(), mLru, it->second);
+    mHits++;
+    return it->second->second;
+}
+
+void MassSpecCache::insert(size_t idx, MapShrdPtr ms)
+{
+    const size_t n = bytesOf(*ms);
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(n > mBudget || mIndex.count(idx)) return;
+    mLru.emplace_front(idx, std::move(ms));
+    mIndex[idx] = mLru.begin();
+    mBytes += n;
+    shrink();
+}
+
+void MassSpecCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLru.clear();
+    mIndex.clear();
+    mBytes = 0;
+}
+
+size_t MassSpecCache::budget() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBudget;
+}
+
+void MassSpecCache::setBudget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mBudget = budget;
+    shrink();
+}
+
+size_t MassSpecCache::bytes() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+size_t MassSpecCache::hits() const
+{
+    return mHits;
+}
+
+size_t MassSpecCache::misses() const
+{
+    return mMisses;
+}
+
+size_t MassSpecCache::bytesOf(const MassSpecImpl::Map &ms)
+{
+    //Red-black tree node keeps three pointers and colour beside the value
+    const size_t nodeSize = sizeof(MassSpecImpl::Map::value_type) + 4 * sizeof(void*);
+    return sizeof(MassSpecImpl::Map) + ms.size() * nodeSize;
+}
+
+void MassSpecCache::shrink()
+{
+    while(mBytes > mBudget && !mLru.empty())
+    {
+        mBytes -= bytesOf(*mLru.back().second);
+        mIndex.erase(mLru.back().first);
+        mLru.pop_back();
+    }
+}
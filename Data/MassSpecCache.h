@@ -0,0 +1,75 @@
+#ifndef MASSSPECCACHE_H
+#define MASSSPECCACHE_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "MassSpecImpl.h"
+
+/**
+ * @brief The MassSpecCache class keeps recently decoded mass spectra
+ * within a memory budget and drops least recently used ones first.
+ * All methods are safe to call from concurrent readers
+ */
+class MassSpecCache
+{
+public:
+    using MapShrdPtr = MassSpecImpl::MapShrdPtr;
+
+    static const size_t s_defaultBudget = 256u << 20;
+
+    explicit MassSpecCache(size_t budget = s_defaultBudget);
+
+    /**
+     * @brief find returns cached mass spectrum or empty pointer
+     * @param idx index of mass spectrum in collection
+     * @return
+     */
+    MapShrdPtr find(size_t idx);
+
+    /**
+     * @brief insert puts decoded mass spectrum into cache
+     * @param idx
+     * @param ms
+     */
+    void insert(size_t idx, MapShrdPtr ms);
+
+    /**
+     * @brief clear drops all cached mass spectra, counters are kept
+     */
+    void clear();
+
+    size_t budget() const;
+    void setBudget(size_t budget);
+
+    size_t bytes() const;
+    size_t hits() const;
+    size_t misses() const;
+
+    /**
+     * @brief bytesOf estimates memory occupied by decoded mass spectrum
+     * @param ms
+     * @return
+     */
+    static size_t bytesOf(const MassSpecImpl::Map& ms);
+
+private:
+    using Entry = std::pair<size_t, MapShrdPtr>;
+    using List = std::list<Entry>;
+
+    mutable std::mutex mMutex;
+    //Most recently used entries are at the front
+    List mLru;
+    std::unordered_map<size_t, List::iterator> mIndex;
+    size_t mBudget;
+    size_t mBytes;
+
+    std::atomic<size_t> mHits;
+    std::atomic<size_t> mMisses;
+
+    void shrink();
+};
+
+#endif // MASSSPECCACHE_H
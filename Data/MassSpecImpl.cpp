@@ -1,9 +1,38 @@
 #include "MassSpecImpl.h"
 #include "PackProc.h"
+#include "MassSpecBuilder.h"
+#include "Math/SumKernels.h"
 #include <algorithm>
+#include <numeric>
 #include <cassert>
 
-MassSpecImpl::MassSpecImpl()
+namespace
+{
+/**
+ * @brief sparse makes map of nonzero intensities of dense data and keeps
+ * their zero neighbours, time of the data[i] is timeZero + i
+ */
+MassSpecImpl::Map sparse(const MassSpecImpl::Vec& data, int timeZero)
+{
+    MassSpecImpl::Map res;
+    if(data.empty()) return res;
+    const int minVal = *std::min_element(data.begin(), data.end());
+    for(size_t i = 0; i < data.size(); ++i)
+    {
+        if(data[i] == minVal) continue;
+        const int t = timeZero + static_cast<int>(i);
+        if(i != 0) res.emplace_hint(res.end(), t - 1, 0);
+        res.emplace_hint(res.end(), t, 0)->second = data[i] - minVal;
+        if(i + 1 != data.size()) res.emplace_hint(res.end(), t + 1, 0);
+    }
+    return res;
+}
+}
+
+MassSpecImpl::MassSpecImpl(PackArena *arena)
+    :
+      mArena(arena),
+      mHandle{0, 0, 0}
 {
 
 }
@@ -13,22 +42,43 @@ MassSpecImpl::~MassSpecImpl()
 
 }
 
-MassSpecImpl * MassSpecImpl::create(Type type, const Map& ms)
+MassSpecImpl * MassSpecImpl::create(Type type, const Map& ms, PackArena * arena)
 {
+    if(type == MassSpecAutoType && !ms.empty())
+    {
+        const size_t nBins = static_cast<size_t>(ms.rbegin()->first - ms.begin()->first) + 1;
+        const size_t nFilled = static_cast<size_t>(std::count_if
+        (
+            ms.begin(),
+            ms.end(),
+            [](Map::const_reference d)->bool{ return d.second != 0; }
+        ));
+        type = MassSpecBuilder::isDense(nBins, nFilled) ? MassSpecVecType : MassSpecMapType;
+    }
     switch(type)
     {
-    case MassSpecMapType: return new MassSpecMap(ms);
-    case MassSpecVecType: return new MassSpecVec(ms);
+    case MassSpecMapType: case MassSpecAutoType: return new MassSpecMap(ms, false, arena);
+    case MassSpecVecType: return new MassSpecVec(ms, false, arena);
     }
     return nullptr;
 }
 
-MassSpecImpl *MassSpecImpl::create(MassSpecImpl::Type type, const MassSpecImpl::Vec &ms)
+MassSpecImpl *MassSpecImpl::create
+(
+    MassSpecImpl::Type type,
+    const MassSpecImpl::Vec &ms,
+    PackArena * arena
+)
 {
+    if(type == MassSpecAutoType)
+    {
+        const size_t nFilled = ms.size() - static_cast<size_t>(std::count(ms.begin(), ms.end(), 0));
+        type = MassSpecBuilder::isDense(ms.size(), nFilled) ? MassSpecVecType : MassSpecMapType;
+    }
     switch(type)
     {
-    case MassSpecMapType: return new MassSpecMap(ms);
-    case MassSpecVecType: return new MassSpecVec(ms);
+    case MassSpecMapType: case MassSpecAutoType: return new MassSpecMap(ms, false, arena);
+    case MassSpecVecType: return new MassSpecVec(ms, false, arena);
     }
     return nullptr;
 }
@@ -38,9 +88,43 @@ void MassSpecImpl::release(MassSpecImpl *ptr)
     delete ptr;
 }
 
-MassSpecMap::MassSpecMap(const Map &data, bool packData)
+void MassSpecImpl::setPacked(const Pack &data)
+{
+    if(mArena)
+    {
+        mHandle = mArena->append(data.data(), data.size());
+    }
+    else
+    {
+        mPackData = data;
+    }
+}
+
+void MassSpecImpl::releasePacked()
+{
+    //Arena is append only, its memory is reclaimed when arena is cleared
+    mHandle = PackArena::Handle{0, 0, 0};
+    mPackData.clear();
+}
+
+bool MassSpecImpl::hasPacked() const
+{
+    return mArena ? mHandle.size != 0 : !mPackData.empty();
+}
+
+const char *MassSpecImpl::packedData() const
+{
+    return mArena ? mArena->data(mHandle) : mPackData.data();
+}
+
+size_t MassSpecImpl::packedSize() const
+{
+    return mArena ? mHandle.size : mPackData.size();
+}
+
+MassSpecMap::MassSpecMap(const Map &data, bool packData, PackArena *arena)
     :
-      mPacker(new ZlibPack)
+      MassSpecImpl(arena)
 {
     if(data.empty()) return;
     int minVal = std::min_element
@@ -62,9 +146,9 @@ MassSpecMap::MassSpecMap(const Map &data, bool packData)
     if(packData) pack();
 }
 
-MassSpecMap::MassSpecMap(const Vec& data, bool packData)
+MassSpecMap::MassSpecMap(const Vec& data, bool packData, PackArena *arena)
     :
-      mPacker(new ZlibPack)
+      MassSpecImpl(arena)
 {
     if(data.empty()) return;
     int minVal = *std::min_element(data.begin(), data.end());
@@ -103,30 +187,20 @@ void MassSpecMap::pack()
     {
         *reinterpret_cast<std::pair<int, int>*>(_First) = *it;
     }
-    mPackData = mPacker->pack(vec);
+    setPacked(PackProc::shared<ZlibPack>().pack(vec));
     mData.clear();
 }
 
 void MassSpecMap::unpack()
 {
     if (!isPacked()) return;
-    PackProc::DataVec unpackedData = mPacker->unpack(mPackData);
-    char * _End = unpackedData.data() + unpackedData.size();
-    for
-    (
-        char * _First = unpackedData.data();
-        _First != _End;
-        _First += sizeof (Map::value_type)
-    )
-    {
-        mData.insert(*reinterpret_cast<Map::const_pointer>(_First));
-    }
-    mPackData.clear();
+    decode(mData);
+    releasePacked();
 }
 
 bool MassSpecMap::isPacked() const
 {
-    return !mPackData.empty();
+    return hasPacked();
 }
 
 int MassSpecMap::operator[](int idx) const
@@ -167,8 +241,9 @@ MassSpecImpl::MapShrdPtr MassSpecMap::data()
 {
     if(isPacked())
     {
-        PackerLock lock(this);
-        return MapShrdPtr(new Map(mData));
+        std::shared_ptr<Map> res(new Map);
+        decode(*res);
+        return res;
     }
     return MapShrdPtr(new Map(mData));
 }
@@ -176,9 +251,13 @@ MassSpecImpl::MapShrdPtr MassSpecMap::data()
 MassSpecImpl::VecShrdPtr MassSpecMap::vecData(int minTimeBin, int maxTimeBin)
 {
     VecShrdPtr res(new Vec(maxTimeBin - minTimeBin + 1));
-    for(int i = 0; minTimeBin <= maxTimeBin; ++i, ++minTimeBin)
+    MapShrdPtr ms = data();
+    Map::const_iterator
+            _First = ms->lower_bound(minTimeBin),
+            _Last = ms->upper_bound(maxTimeBin);
+    for(; _First != _Last; ++_First)
     {
-        (*res)[i] = static_cast<const MassSpecImpl*>(this)->operator[](i);
+        (*res)[_First->first - minTimeBin] = _First->second;
     }
     return res;
 }
@@ -197,7 +276,7 @@ MassSpecImpl::Map::value_type MassSpecMap::last() const
 
 bool MassSpecMap::isEmpty() const
 {
-    return mData.empty() && mPackData.empty();
+    return mData.empty() && !hasPacked();
 }
 
 int MassSpecMap::tic(int t0, int t1) const
@@ -213,6 +292,45 @@ int MassSpecMap::tic(int t0, int t1) const
     return res;
 }
 
+int MassSpecMap::totalIonCurrent() const
+{
+    int res = 0;
+    if(isPacked())
+    {
+        Map ms;
+        decode(ms);
+        for(Map::const_reference d : ms) res += d.second;
+    }
+    else
+    {
+        for(Map::const_reference d : mData) res += d.second;
+    }
+    return res;
+}
+
+void MassSpecMap::addTo(int64_t *acc, int minBin, int maxBin) const
+{
+    if(isPacked())
+    {
+        PackProc::DataVec unpackedData
+                = PackProc::shared<ZlibPack>().unpack(packedData(), packedSize());
+        Map::const_pointer _First = reinterpret_cast<Map::const_pointer>(unpackedData.data());
+        Map::const_pointer _Last = _First + unpackedData.size() / sizeof (Map::value_type);
+        math::addSparseToDense(acc, minBin, maxBin - minBin + 1, _First, _Last);
+    }
+    else
+    {
+        math::addSparseToDense
+        (
+            acc,
+            minBin,
+            maxBin - minBin + 1,
+            mData.lower_bound(minBin),
+            mData.end()
+        );
+    }
+}
+
 void MassSpecMap::increaseEvtIter(Map::iterator it, int nEvents)
 {
     it->second += nEvents;
@@ -226,11 +344,29 @@ void MassSpecMap::increaseEvtIter(Map::iterator it, int nEvents)
     }
 }
 
+void MassSpecMap::decode(Map &out) const
+{
+    PackProc::DataVec unpackedData
+            = PackProc::shared<ZlibPack>().unpack(packedData(), packedSize());
+    const char * _End = unpackedData.data() + unpackedData.size();
+    Map::const_iterator hint = out.end();
+    for
+    (
+        const char * _First = unpackedData.data();
+        _First != _End;
+        _First += sizeof (Map::value_type)
+    )
+    {
+        hint = out.insert(hint, *reinterpret_cast<Map::const_pointer>(_First));
+        ++hint;
+    }
+}
+
 
 
-MassSpecVec::MassSpecVec(const MassSpecImpl::Map &ms, bool packData)
+MassSpecVec::MassSpecVec(const MassSpecImpl::Map &ms, bool packData, PackArena *arena)
     :
-      mPacker(new SimpleAndZlibPack)
+      MassSpecImpl(arena)
 {
     nTimeZero = ms.empty() ? 0 : ms.begin()->first;
     if(!ms.empty())
@@ -245,10 +381,10 @@ MassSpecVec::MassSpecVec(const MassSpecImpl::Map &ms, bool packData)
     if(packData) pack();
 }
 
-MassSpecVec::MassSpecVec(const MassSpecImpl::Vec &ms, bool packData)
+MassSpecVec::MassSpecVec(const MassSpecImpl::Vec &ms, bool packData, PackArena *arena)
     :
+      MassSpecImpl(arena),
       mData(ms),
-      mPacker(new SimpleAndZlibPack),
       nTimeZero(0)
 {
     if(packData) pack();
@@ -275,28 +411,22 @@ void MassSpecVec::pack()
             reinterpret_cast<DataVec::pointer>(mData.data() + mData.size())
         );
         mData.clear();
-        mPackData = mPacker->pack(data);
+        setPacked(PackProc::shared<SimpleAndZlibPack>().pack(data));
     }
 }
 
 void MassSpecVec::unpack()
 {
-    using DataVec = PackProc::DataVec;
     if(isPacked())
     {
-        DataVec data = mPacker->unpack(mPackData);
-        mPackData.clear();
-        mData.assign
-        (
-            reinterpret_cast<int*>(data.data()),
-            reinterpret_cast<int*>(data.data() + data.size())
-        );
+        decode(mData);
+        releasePacked();
     }
 }
 
 bool MassSpecVec::isPacked() const
 {
-    return !mPackData.empty();
+    return hasPacked();
 }
 
 int MassSpecVec::operator[](int idx) const
@@ -346,18 +476,25 @@ void MassSpecVec::addEvents(int time, int nEvents)
 
 MassSpecImpl::MapShrdPtr MassSpecVec::data()
 {
-    MassSpecImpl::PackerLock lock(this);
-    return MassSpecMap(mData).data();
+    if(isPacked())
+    {
+        Vec ms;
+        decode(ms);
+        return MapShrdPtr(new Map(sparse(ms, nTimeZero)));
+    }
+    return MapShrdPtr(new Map(sparse(mData, nTimeZero)));
 }
 
 MassSpecImpl::VecShrdPtr MassSpecVec::vecData(int minTimeBin, int maxTimeBin)
 {
-    std::unique_ptr<MassSpecImpl::PackerLock> packerLock;
-    if(isPacked()) packerLock.reset(new PackerLock(this));
+    Vec unpacked;
+    if(isPacked()) decode(unpacked);
+    const Vec& ms = isPacked() ? unpacked : mData;
     Vec res(maxTimeBin - minTimeBin + 1, 0);
     for(size_t i = 0; minTimeBin <= maxTimeBin; ++minTimeBin, ++i)
     {
-        res[i] = static_cast<const MassSpecImpl*>(this)->operator[](minTimeBin);
+        const int idx = minTimeBin - nTimeZero;
+        if(idx >= 0 && static_cast<size_t>(idx) < ms.size()) res[i] = ms[idx];
     }
     return VecShrdPtr(new Vec(std::move(res)));
 }
@@ -376,7 +513,7 @@ MassSpecImpl::Map::value_type MassSpecVec::last() const
 
 bool MassSpecVec::isEmpty() const
 {
-    return mPackData.empty() && mData.empty();
+    return !hasPacked() && mData.empty();
 }
 
 int MassSpecVec::tic(int t0, int t1) const
@@ -393,6 +530,25 @@ int MassSpecVec::tic(int t0, int t1) const
     return res;
 }
 
+int MassSpecVec::totalIonCurrent() const
+{
+    if(isPacked())
+    {
+        Vec ms;
+        decode(ms);
+        return std::accumulate(ms.begin(), ms.end(), 0);
+    }
+    return std::accumulate(mData.begin(), mData.end(), 0);
+}
+
+void MassSpecVec::addTo(int64_t *acc, int minBin, int maxBin) const
+{
+    Vec unpacked;
+    if(isPacked()) decode(unpacked);
+    const Vec& ms = isPacked() ? unpacked : mData;
+    math::addDenseToDense(acc, minBin, maxBin - minBin + 1, ms.data(), nTimeZero, ms.size());
+}
+
 void MassSpecVec::extendDataToKeepEvent(int evt)
 {
     if(evt < nTimeZero)
@@ -407,3 +563,17 @@ void MassSpecVec::extendDataToKeepEvent(int evt)
         mData.insert(mData.end(), evt - (nTimeZero + mData.size()) + 1, 0);
     }
 }
+
+void MassSpecVec::decode(Vec &out) const
+{
+    PackProc::DataVec data = PackProc::shared<SimpleAndZlibPack>().unpack
+    (
+        packedData(),
+        packedSize()
+    );
+    out.assign
+    (
+        reinterpret_cast<const int*>(data.data()),
+        reinterpret_cast<const int*>(data.data() + data.size())
+    );
+}
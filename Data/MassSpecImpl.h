@@ -1,10 +1,13 @@
 #ifndef MASSSPECIMPL_H
 #define MASSSPECIMPL_H
 
+#include <cstdint>
 #include <memory>
 #include <map>
 #include <vector>
 
+#include "PackArena.h"
+
 /**
  * @brief The MassSpecImpl class represents base mass spectrum property:
  * return intensity by idx
@@ -18,14 +21,15 @@ public:
     using Map = std::map<int, int>;
     using Vec = std::vector<int>;
     using Pack = std::vector<char>;
-    using Packer = std::shared_ptr<PackProc>;
-    using MapShrdPtr = std::shared_ptr<Map>;
+    using MapShrdPtr = std::shared_ptr<const Map>;
     using VecShrdPtr = std::shared_ptr<Vec>;
 
     enum Type
     {
         MassSpecMapType,
-        MassSpecVecType
+        MassSpecVecType,
+        //Map or vector is chosen for each spectrum by occupancy of its bins
+        MassSpecAutoType
     };
 
     /**
@@ -47,11 +51,15 @@ public:
         }
     };
 
-    MassSpecImpl();
+    MassSpecImpl(PackArena * arena = nullptr);
     virtual ~MassSpecImpl();
 
-    static MassSpecImpl * create(Type type, const Map &ms = Map());
-    static MassSpecImpl * create(Type type, const Vec &ms = Vec());
+    /**
+     * @brief create creates mass spectrum, packed data of which will be
+     * kept in arena. If arena is nullptr spectrum keeps packed data itself
+     */
+    static MassSpecImpl * create(Type type, const Map &ms = Map(), PackArena * arena = nullptr);
+    static MassSpecImpl * create(Type type, const Vec &ms = Vec(), PackArena * arena = nullptr);
     static void release(MassSpecImpl * ptr);
 
     virtual Type type() const = 0;
@@ -87,7 +95,8 @@ public:
     virtual void addEvents(int time, int nEvents) = 0;
 
     /**
-     * @brief data returns inner data representation
+     * @brief data returns inner data representation. Packed spectrum
+     * is decoded into the returned copy and stays packed
      * @return
      */
     virtual MapShrdPtr data() = 0;
@@ -113,6 +122,38 @@ public:
      * @return
      */
     virtual int tic(int t0, int t1) const = 0;
+
+    /**
+     * @brief totalIonCurrent returns number of all events in mass spectrum
+     * @return
+     */
+    virtual int totalIonCurrent() const = 0;
+
+    /**
+     * @brief addTo adds intensities of bins in [minBin, maxBin] to the dense
+     * accumulator. Packed data is decoded directly into acc
+     * @param acc acc[0] corresponds to minBin
+     * @param minBin
+     * @param maxBin
+     */
+    virtual void addTo(int64_t * acc, int minBin, int maxBin) const = 0;
+
+protected:
+    /**
+     * @brief setPacked stores packed data into arena or inside the object
+     * @param data
+     */
+    void setPacked(const Pack& data);
+    void releasePacked();
+    bool hasPacked() const;
+    const char * packedData() const;
+    size_t packedSize() const;
+
+private:
+    PackArena * mArena;
+    PackArena::Handle mHandle;
+    //Used instead of arena if no arena was supplied
+    Pack mPackData;
 };
 
 /**
@@ -121,12 +162,11 @@ public:
 class MassSpecMap : public MassSpecImpl
 {
     Map mData;
-    Pack mPackData;
-    Packer mPacker;
+    friend class MassSpecBuilder;
 public:
 
-    MassSpecMap(const Map& data = Map(), bool packData = false);
-    MassSpecMap(const Vec& data = Vec(), bool packData = false);
+    MassSpecMap(const Map& data = Map(), bool packData = false, PackArena * arena = nullptr);
+    MassSpecMap(const Vec& data = Vec(), bool packData = false, PackArena * arena = nullptr);
     ~MassSpecMap();
 
     Type type() const;
@@ -151,20 +191,23 @@ public:
     bool isEmpty() const;
 
     int tic(int t0, int t1) const;
+    int totalIonCurrent() const;
+    void addTo(int64_t * acc, int minBin, int maxBin) const;
 private:
     void increaseEvtIter(Map::iterator it, int nEvents = 1);
+    //Decodes packed data without unpacking of the object
+    void decode(Map& out) const;
 };
 
 class MassSpecVec : public MassSpecImpl
 {
     Vec mData;
-    Pack mPackData;
-    Packer mPacker;
     int nTimeZero;
+    friend class MassSpecBuilder;
 public:
 
-    MassSpecVec(const Map& ms = Map(), bool packData = false);
-    MassSpecVec(const Vec& ms = Vec(), bool packData = false);
+    MassSpecVec(const Map& ms = Map(), bool packData = false, PackArena * arena = nullptr);
+    MassSpecVec(const Vec& ms = Vec(), bool packData = false, PackArena * arena = nullptr);
     ~MassSpecVec();
 
     Type type() const;
@@ -189,8 +232,12 @@ public:
     bool isEmpty() const;
 
     int tic(int t0, int t1) const;
+    int totalIonCurrent() const;
+    void addTo(int64_t * acc, int minBin, int maxBin) const;
 private:
      void extendDataToKeepEvent(int evt);
+     //Decodes packed data without unpacking of the object
+     void decode(Vec& out) const;
 };
 
 #endif // MASSSPECIMPL_H
@@ -0,0 +1,187 @@
+#include "MassSpecStore.h"
+#include "Math/SumKernels.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+MassSpecStore::MassSpecStore(PackArena::Storage storage, size_t cacheBudget)
+    :
+      mSize(0),
+      mMinBin(std::numeric_limits<int>::max()),
+      mMaxBin(std::numeric_limits<int>::min()),
+      mArena(storage),
+      mCache(cacheBudget),
+      mTotal{std::vector<int64_t>(), 0, 0}
+{
+    mChunks.reserve(s_maxChunksNum);
+}
+
+MassSpecStore::~MassSpecStore()
+{
+    const size_t n = size();
+    for(size_t i = 0; i < n; ++i)
+        MassSpecImpl::release(at(i));
+}
+
+MassSpecImpl::MapShrdPtr MassSpecStore::massSpec(size_t idx)
+{
+    MassSpecImpl::MapShrdPtr res = mCache.find(idx);
+    if(!res)
+    {
+        res = at(idx)->data();
+        mCache.insert(idx, res);
+    }
+    return res;
+}
+
+MassSpecStore::Counts MassSpecStore::counts(const MassSpecImpl &ms)
+{
+    Counts res{std::vector<int64_t>(), 0, ms.totalIonCurrent()};
+    if(!ms.isEmpty())
+    {
+        res.first = ms.first().first;
+        const int last = ms.last().first;
+        res.hist.assign(static_cast<size_t>(last - res.first) + 1, 0);
+        ms.addTo(res.hist.data(), res.first, last);
+    }
+    return res;
+}
+
+void MassSpecStore::push(MassSpecImpl *ms, const Counts &counts)
+{
+    const size_t n = mSize.load(std::memory_order_relaxed);
+    if(n % s_chunkSize == 0)
+    {
+        if(mChunks.size() == s_maxChunksNum)
+            throw std::runtime_error("Too many mass spectra in collection!");
+        mChunks.emplace_back(new Entry[s_chunkSize]);
+    }
+    mChunks[n / s_chunkSize][n % s_chunkSize] = Entry{ms, counts.tic};
+    {
+        std::lock_guard<std::mutex> lock(mTotalMutex);
+        const int lo = minBin(), hi = maxBin();
+        if(!counts.hist.empty() && lo <= hi)
+        {
+            const size_t nBins = static_cast<size_t>(hi - lo) + 1;
+            if(mTotal.acc.size() != nBins || mTotal.minBin != lo)
+            {
+                //Limits were widened, total is moved into the new range
+                std::vector<int64_t> acc(nBins, 0);
+                addTotal(mTotal, acc.data(), lo, hi, 1);
+                mTotal.acc.swap(acc);
+                mTotal.minBin = lo;
+            }
+            math::addDenseToDense
+            (
+                mTotal.acc.data(),
+                lo,
+                nBins,
+                counts.hist.data(),
+                counts.first,
+                counts.hist.size()
+            );
+        }
+        mTotal.count = n + 1;
+    }
+    mSize.store(n + 1, std::memory_order_release);
+}
+
+void MassSpecStore::copyTotals(const MassSpecStore &other)
+{
+    std::lock(mTotalMutex, other.mTotalMutex);
+    std::lock_guard<std::mutex> lock(mTotalMutex, std::adopt_lock);
+    std::lock_guard<std::mutex> otherLock(other.mTotalMutex, std::adopt_lock);
+    mTotal = other.mTotal;
+    mCheckpoints = other.mCheckpoints;
+}
+
+size_t MassSpecStore::addTotal(int64_t *acc, int minBin, int maxBin) const
+{
+    std::lock_guard<std::mutex> lock(mTotalMutex);
+    addTotal(mTotal, acc, minBin, maxBin, 1);
+    return mTotal.count;
+}
+
+size_t MassSpecStore::checkpoint()
+{
+    std::lock_guard<std::mutex> lock(mTotalMutex);
+    if(mCheckpoints.empty() || mCheckpoints.back().count != mTotal.count)
+        mCheckpoints.push_back(mTotal);
+    return mTotal.count;
+}
+
+size_t MassSpecStore::subCheckpoint(int64_t *acc, int minBin, int maxBin, size_t first) const
+{
+    std::lock_guard<std::mutex> lock(mTotalMutex);
+    const Total * t = checkpointBefore(first);
+    if(!t) return 0;
+    addTotal(*t, acc, minBin, maxBin, -1);
+    return t->count;
+}
+
+size_t MassSpecStore::checkpointCount(size_t first) const
+{
+    std::lock_guard<std::mutex> lock(mTotalMutex);
+    const Total * t = checkpointBefore(first);
+    return t ? t->count : 0;
+}
+
+const MassSpecStore::Total *MassSpecStore::checkpointBefore(size_t first) const
+{
+    auto it = std::upper_bound
+    (
+        mCheckpoints.begin(),
+        mCheckpoints.end(),
+        first,
+        [](size_t n, const Total& t)->bool
+        {
+            return n < t.count;
+        }
+    );
+    return it == mCheckpoints.begin() ? nullptr : &*(--it);
+}
+
+void MassSpecStore::addTotal
+(
+    const Total &total,
+    int64_t *acc,
+    int minBin,
+    int maxBin,
+    int sign
+)
+{
+    const int64_t t0 = std::max<int64_t>(minBin, total.minBin);
+    const int64_t t1 = std::min<int64_t>
+    (
+        int64_t(maxBin) + 1,
+        int64_t(total.minBin) + int64_t(total.acc.size())
+    );
+    for(int64_t t = t0; t < t1; ++t)
+        acc[t - minBin] += sign * total.acc[static_cast<size_t>(t - total.minBin)];
+}
+
+bool MassSpecStore::updateLimits(int minBin, int maxBin)
+{
+    bool res = false;
+    if(minBin < mMinBin.load(std::memory_order_relaxed))
+    {
+        mMinBin.store(minBin, std::memory_order_release);
+        res = true;
+    }
+    if(maxBin > mMaxBin.load(std::memory_order_relaxed))
+    {
+        mMaxBin.store(maxBin, std::memory_order_release);
+        res = true;
+    }
+    return res;
+}
+
+PackArena *MassSpecStore::arena()
+{
+    return &mArena;
+}
+
+MassSpecCache *MassSpecStore::cache()
+{
+    return &mCache;
+}
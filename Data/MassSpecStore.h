@@ -0,0 +1,173 @@
+#ifndef MASSSPECSTORE_H
+#define MASSSPECSTORE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "MassSpecImpl.h"
+#include "MassSpecCache.h"
+
+/**
+ * @brief The MassSpecStore class is append-only index of published packed
+ * mass spectra together with the arena of their data and the cache of
+ * decoded ones. Only one writer is allowed, readers need no locks and see
+ * the prefix of size() spectra. Published spectra are never changed, so the
+ * store is replaced as a whole when spectra have to be rebuilt
+ */
+class MassSpecStore
+{
+public:
+    static const size_t s_chunkSize = 4096;
+
+    /**
+     * @brief The Counts struct is unpacked data of a mass spectrum which
+     * feeds running total, hist[i] is intensity of the bin first + i
+     */
+    struct Counts
+    {
+        std::vector<int64_t> hist;
+        int first;
+        int tic;
+    };
+
+    /**
+     * @brief counts takes counts of unpacked mass spectrum
+     */
+    static Counts counts(const MassSpecImpl& ms);
+    static const size_t s_maxChunksNum = 1u << 16;
+
+    explicit MassSpecStore
+    (
+        PackArena::Storage storage = PackArena::MemoryStorage,
+        size_t cacheBudget = MassSpecCache::s_defaultBudget
+    );
+    ~MassSpecStore();
+
+    MassSpecStore(const MassSpecStore&) = delete;
+    MassSpecStore& operator=(const MassSpecStore&) = delete;
+
+    /**
+     * @brief size number of published mass spectra
+     * @return
+     */
+    inline size_t size() const
+    {
+        return mSize.load(std::memory_order_acquire);
+    }
+
+    inline MassSpecImpl * at(size_t idx) const
+    {
+        return mChunks[idx / s_chunkSize][idx % s_chunkSize].ms;
+    }
+
+    /**
+     * @brief tic returns total ion current of mass spectrum, it is
+     * calculated once when mass spectrum is published
+     * @param idx
+     * @return
+     */
+    inline int tic(size_t idx) const
+    {
+        return mChunks[idx / s_chunkSize][idx % s_chunkSize].tic;
+    }
+
+    /**
+     * @brief massSpec returns decoded mass spectrum using cache
+     * @param idx
+     * @return
+     */
+    MassSpecImpl::MapShrdPtr massSpec(size_t idx);
+
+    /**
+     * @brief push publishes packed mass spectrum, store takes ownership of it.
+     * Running total is fed by counts taken before packing, so ms is neither
+     * decoded nor put into cache
+     * @param ms
+     * @param counts counts of ms
+     */
+    void push(MassSpecImpl * ms, const Counts& counts);
+
+    /**
+     * @brief copyTotals replaces running total and checkpoints by the ones of
+     * other which holds the same mass spectra
+     */
+    void copyTotals(const MassSpecStore& other);
+
+    /**
+     * @brief addTotal adds running total of all pushed mass spectra in
+     * [minBin, maxBin] to acc
+     * @return number of mass spectra in the total
+     */
+    size_t addTotal(int64_t * acc, int minBin, int maxBin) const;
+
+    /**
+     * @brief checkpoint saves current running total, so sums since the
+     * checkpoint need no pass through earlier mass spectra
+     * @return number of mass spectra in the saved total
+     */
+    size_t checkpoint();
+
+    /**
+     * @brief subCheckpoint subtracts the latest checkpoint made not after
+     * mass spectrum first from acc
+     * @return number of mass spectra in subtracted total, 0 if there is none
+     */
+    size_t subCheckpoint(int64_t * acc, int minBin, int maxBin, size_t first) const;
+
+    /**
+     * @brief checkpointCount number of mass spectra in the checkpoint which
+     * subCheckpoint would subtract for first
+     */
+    size_t checkpointCount(size_t first) const;
+
+    /**
+     * @brief updateLimits widens time limits of the store
+     * @return true if limits were changed
+     */
+    bool updateLimits(int minBin, int maxBin);
+
+    inline int minBin() const { return mMinBin.load(std::memory_order_acquire); }
+    inline int maxBin() const { return mMaxBin.load(std::memory_order_acquire); }
+
+    PackArena * arena();
+    MassSpecCache * cache();
+
+private:
+    struct Entry
+    {
+        MassSpecImpl * ms;
+        int tic;
+    };
+
+    /**
+     * @brief The Total struct is dense sum of the first count mass spectra
+     */
+    struct Total
+    {
+        std::vector<int64_t> acc;
+        int minBin;
+        size_t count;
+    };
+
+    //Chunk directory, reserved once for s_maxChunksNum entries
+    std::vector<std::unique_ptr<Entry[]>> mChunks;
+    std::atomic<size_t> mSize;
+    std::atomic<int> mMinBin;
+    std::atomic<int> mMaxBin;
+    PackArena mArena;
+    MassSpecCache mCache;
+
+    //Guards running total and checkpoints
+    mutable std::mutex mTotalMutex;
+    Total mTotal;
+    //Ordered by count
+    std::vector<Total> mCheckpoints;
+
+    static void addTotal(const Total& total, int64_t * acc, int minBin, int maxBin, int sign);
+    //The latest checkpoint made not after first, mTotalMutex is held
+    const Total * checkpointBefore(size_t first) const;
+};
+
+#endif // MASSSPECSTORE_H
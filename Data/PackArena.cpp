@@ -0,0 +1,132 @@
+#include "PackArena.h"
+#include <QTemporaryFile>
+#include <QDir>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+PackArena::PackArena(Storage storage, size_t slabSize)
+    :
+      mStorage(storage),
+      mSlabSize(slabSize),
+      mFileSize(0),
+      mTail(0),
+      mTailSlab(0),
+      mBytesUsed(0),
+      mBytesReserved(0)
+{
+    mSlabs.reserve(s_maxSlabsNum);
+    mOwned.reserve(s_maxSlabsNum);
+}
+
+PackArena::~PackArena()
+{
+
+}
+
+PackArena::Handle PackArena::append(const char *data, size_t n)
+{
+    if(n > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Packed mass spectrum is too large!");
+    std::lock_guard<std::mutex> lock(mMutex);
+    Handle h{0, 0, static_cast<uint32_t>(n)};
+    if(n == 0) return h;
+    char * dest;
+    if(n > mSlabSize / 4)
+    {
+        //Large payloads get their own slab, the tail slab is kept
+        dest = allocSlab(n, h.slab);
+    }
+    else
+    {
+        if(mTail < n || mSlabs.empty())
+        {
+            allocSlab(mSlabSize, mTailSlab);
+            mTail = mSlabSize;
+        }
+        h.slab = mTailSlab;
+        h.offset = static_cast<uint32_t>(mSlabSize - mTail);
+        dest = mSlabs[h.slab] + h.offset;
+        mTail -= n;
+    }
+    std::memcpy(dest, data, n);
+    mBytesUsed += n;
+    return h;
+}
+
+void PackArena::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSlabs.clear();
+    mOwned.clear();
+    //Closing of the file unmaps all slabs
+    mFile.reset();
+    mFileSize = 0;
+    mTail = 0;
+    mTailSlab = 0;
+    mBytesUsed = 0;
+    mBytesReserved = 0;
+}
+
+PackArena::Storage PackArena::storage() const
+{
+    return mStorage;
+}
+
+size_t PackArena::bytesUsed() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytesUsed;
+}
+
+size_t PackArena::bytesReserved() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytesReserved;
+}
+
+size_t PackArena::slabsNum() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSlabs.size();
+}
+
+char *PackArena::allocSlab(size_t n, uint32_t &idx)
+{
+    if(mSlabs.size() == s_maxSlabsNum)
+        throw std::runtime_error("Pack arena is full!");
+    if(mStorage == MappedFileStorage)
+    {
+        mSlabs.push_back(mapSlab(n));
+    }
+    else
+    {
+        mOwned.emplace_back(new char[n]);
+        mSlabs.push_back(mOwned.back().get());
+    }
+    mBytesReserved += n;
+    idx = static_cast<uint32_t>(mSlabs.size() - 1);
+    return mSlabs.back();
+}
+
+char *PackArena::mapSlab(size_t n)
+{
+    if(!mFile)
+    {
+        mFile.reset(new QTemporaryFile(QDir::temp().filePath("processRikenData_XXXXXX.pack")));
+        if(!mFile->open())
+            throw std::runtime_error("Could not create scratch file for mass spectra!");
+    }
+    const size_t nMapped = (n + s_mapGranularity - 1) / s_mapGranularity * s_mapGranularity;
+    if(!mFile->resize(static_cast<qint64>(mFileSize + nMapped)))
+        throw std::runtime_error("Could not grow scratch file for mass spectra!");
+    uchar * slab = mFile->map
+    (
+        static_cast<qint64>(mFileSize),
+        static_cast<qint64>(nMapped)
+    );
+    if(!slab)
+        throw std::runtime_error("Could not map scratch file for mass spectra!");
+    mFileSize += nMapped;
+    return reinterpret_cast<char*>(slab);
+}
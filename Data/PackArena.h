@@ -0,0 +1,106 @@
+#ifndef PACKARENA_H
+#define PACKARENA_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class QTemporaryFile;
+
+/**
+ * @brief The PackArena class keeps packed mass spectra payloads in a few
+ * large append-only slabs. Payloads are addressed by handles and never move,
+ * so published handles stay valid until clear() is called.
+ * Slabs are either allocated on heap or mapped from the scratch file, the
+ * last way lets OS page out data which does not fit into RAM
+ */
+class PackArena
+{
+public:
+    enum Storage
+    {
+        MemoryStorage,
+        MappedFileStorage
+    };
+
+    /**
+     * @brief The Handle struct points to a payload inside the arena
+     */
+    struct Handle
+    {
+        uint32_t slab;
+        uint32_t offset;
+        uint32_t size; //zero size means no payload
+    };
+
+    static const size_t s_defaultSlabSize = 16u << 20;
+    static const size_t s_maxSlabsNum = 1u << 16;
+    //Mapped regions start at multiples of this value
+    static const size_t s_mapGranularity = 1u << 16;
+
+    explicit PackArena
+    (
+        Storage storage = MemoryStorage,
+        size_t slabSize = s_defaultSlabSize
+    );
+    ~PackArena();
+
+    PackArena(const PackArena&) = delete;
+    PackArena& operator=(const PackArena&) = delete;
+
+    /**
+     * @brief append copies payload into the arena
+     * @param data
+     * @param n number of bytes
+     * @return handle of the stored payload
+     */
+    Handle append(const char * data, size_t n);
+
+    /**
+     * @brief data returns pointer to the first byte of payload. Reading is
+     * lock free: slab directory is never reallocated
+     * @param h
+     * @return
+     */
+    inline const char * data(const Handle& h) const
+    {
+        return mSlabs[h.slab] + h.offset;
+    }
+
+    /**
+     * @brief clear frees all slabs at once, all handles become invalid
+     */
+    void clear();
+
+    Storage storage() const;
+
+    size_t bytesUsed() const;
+    size_t bytesReserved() const;
+    size_t slabsNum() const;
+
+private:
+    const Storage mStorage;
+    const size_t mSlabSize;
+
+    mutable std::mutex mMutex;
+
+    //Slab directory, reserved once for s_maxSlabsNum entries
+    std::vector<char*> mSlabs;
+    std::vector<std::unique_ptr<char[]>> mOwned;
+    //Scratch file for MappedFileStorage, removed together with the arena
+    std::unique_ptr<QTemporaryFile> mFile;
+    size_t mFileSize;
+
+    //Free bytes at the end of the last regular slab
+    size_t mTail;
+    uint32_t mTailSlab;
+
+    size_t mBytesUsed;
+    size_t mBytesReserved;
+
+    char * allocSlab(size_t n, uint32_t& idx);
+    char * mapSlab(size_t n);
+};
+
+#endif // PACKARENA_H
@@ -1,5 +1,6 @@
 #include "PackProc.h"
 #include <zlib.h>
+#include <cstring>
 
 PackProc::PackProc()
 {
@@ -27,7 +28,8 @@ PackProc::DataVec ZlibPack::pack(const PackProc::DataVec &in)
     assert(std::numeric_limits<uLong>::max() / 12 > n);
     uLong destL = (static_cast<uLong>(n) * 12) / 10;
     DataVec res(destL + sizeof (size_t));
-    *reinterpret_cast<size_t*>(res.data()) = n; //keep unpacked size
+    //Keep unpacked size, header may be unaligned inside arena
+    std::memcpy(res.data(), &n, sizeof n);
     char * destFirst = res.data() + sizeof (size_t);
     int err = compress
     (
@@ -42,12 +44,13 @@ PackProc::DataVec ZlibPack::pack(const PackProc::DataVec &in)
     return res;
 }
 
-PackProc::DataVec ZlibPack::unpack(const PackProc::DataVec &in)
+PackProc::DataVec ZlibPack::unpack(const char *in, size_t n)
 {
-    const size_t sourceL = in.size() - sizeof (size_t);
-    const Bytef * src = reinterpret_cast<const Bytef*>(in.data() + sizeof (size_t));
-    const uLong destL
-            = static_cast<uLong>(*reinterpret_cast<const size_t*>(in.data()));
+    const size_t sourceL = n - sizeof (size_t);
+    const Bytef * src = reinterpret_cast<const Bytef*>(in + sizeof (size_t));
+    size_t unpackedSize;
+    std::memcpy(&unpackedSize, in, sizeof unpackedSize);
+    const uLong destL = static_cast<uLong>(unpackedSize);
     DataVec res(destL);
     uLong destL2 = destL;
     int err = uncompress
@@ -63,9 +66,6 @@ PackProc::DataVec ZlibPack::unpack(const PackProc::DataVec &in)
 }
 
 SimpleAndZlibPack::SimpleAndZlibPack()
-    :
-      mZlibPack(new ZlibPack),
-      mSimplePack(new SimplePack<int>)
 {
 
 }
@@ -77,10 +77,10 @@ SimpleAndZlibPack::~SimpleAndZlibPack()
 
 PackProc::DataVec SimpleAndZlibPack::pack(const PackProc::DataVec &in)
 {
-    return mZlibPack->pack(mSimplePack->pack(in));
+    return shared<ZlibPack>().pack(shared<SimplePack<int>>().pack(in));
 }
 
-PackProc::DataVec SimpleAndZlibPack::unpack(const PackProc::DataVec &in)
+PackProc::DataVec SimpleAndZlibPack::unpack(const char *in, size_t n)
 {
-    return mSimplePack->unpack(mZlibPack->unpack(in));
+    return shared<SimplePack<int>>().unpack(shared<ZlibPack>().unpack(in, n));
 }
@@ -5,9 +5,13 @@
 #include <vector>
 #include <cassert>
 #include <memory>
+#include <limits>
+#include <stdexcept>
+#include <string>
 
 /**
- * @brief The PackProc class packing procedures
+ * @brief The PackProc class packing procedures. Implementations keep no state
+ * between calls, so one instance can be shared by all threads
  */
 class PackProc
 {
@@ -17,8 +21,29 @@ public:
     PackProc();
     virtual ~PackProc();
 
+    /**
+     * @brief shared returns process wide instance of packer
+     * @return
+     */
+    template<typename Packer> static Packer& shared()
+    {
+        static Packer s_packer;
+        return s_packer;
+    }
+
     virtual DataVec pack(const DataVec& in) = 0;
-    virtual DataVec unpack(const DataVec& in) = 0;
+    /**
+     * @brief unpack unpacks data directly from memory, e.g. from a pack arena
+     * @param in first byte of packed data
+     * @param n number of packed bytes
+     * @return
+     */
+    virtual DataVec unpack(const char * in, size_t n) = 0;
+
+    inline DataVec unpack(const DataVec& in)
+    {
+        return unpack(in.data(), in.size());
+    }
 };
 
 class ZlibPack : public PackProc
@@ -27,8 +52,10 @@ public:
     ZlibPack();
     virtual ~ZlibPack();
 
+    using PackProc::unpack;
+
     virtual DataVec pack(const DataVec& in);
-    virtual DataVec unpack(const DataVec& in);
+    virtual DataVec unpack(const char * in, size_t n);
 };
 
 /**
@@ -53,8 +80,10 @@ public:
     SimplePack() {}
     virtual ~SimplePack() {}
 
+    using PackProc::unpack;
+
     virtual DataVec pack(const DataVec& in);
-    virtual DataVec unpack(const DataVec& in);
+    virtual DataVec unpack(const char * in, size_t n);
 
 private:
     template<unsigned short N>
@@ -225,9 +254,9 @@ PackProc::DataVec SimplePack<Int>::pack(const PackProc::DataVec &in)
 }
 
 template<typename Int>
-PackProc::DataVec SimplePack<Int>::unpack(const PackProc::DataVec &in)
+PackProc::DataVec SimplePack<Int>::unpack(const char * in, size_t /*n*/)
 {
-    const char * _Cur = in.data();
+    const char * _Cur = in;
     const Header* h = reinterpret_cast<const Header*>(_Cur);
     if (h->tag != std::string("BDS"))
         throw (std::runtime_error("Unknown file!"));
@@ -263,14 +292,14 @@ PackProc::DataVec SimplePack<Int>::unpack(const PackProc::DataVec &in)
  */
 class SimpleAndZlibPack : public PackProc
 {
-    std::unique_ptr<PackProc> mZlibPack;
-    std::unique_ptr<PackProc> mSimplePack;
 public:
     SimpleAndZlibPack();
     ~SimpleAndZlibPack();
 
+    using PackProc::unpack;
+
     DataVec pack(const DataVec& in);
-    DataVec unpack(const DataVec& in);
+    DataVec unpack(const char * in, size_t n);
 };
 
 #endif // PACKPROC_H
@@ -2,6 +2,7 @@
 #include "Base/BaseObject.h"
 #include "Data/TimeEvents.h"
 #include "Data/PackProc.h"
+#include "Data/Ingest.h"
 
 #include <QProcess>
 #include <QInputDialog>
@@ -14,14 +15,48 @@
 Reader::Reader(QObject *parent)
     :
       QObject (parent),
-      mStopFlag(false)
+      mJob(new Job),
+      mOwnsJob(true)
 {
 
 }
 
-void Reader::stop()
+void Reader::run()
+{
+    Job::Scope scope(mJob.get());
+    try
+    {
+        read();
+    }
+    catch(const Job::Cancelled&)
+    {
+    }
+    //Exception must not leave QRunnable::run, so it is reported by the job
+    catch(const std::exception& e)
+    {
+        mJob->fail(QString::fromLocal8Bit(e.what()));
+    }
+    catch(...)
+    {
+        mJob->fail(tr("Unknown error"));
+    }
+    if(mOwnsJob) mJob->finish();
+}
+
+const Job::Ptr &Reader::job() const
 {
+    return mJob;
+}
 
+void Reader::setJob(const Job::Ptr &job)
+{
+    mJob = job;
+    mOwnsJob = false;
+}
+
+void Reader::stop()
+{
+    mJob->cancel();
 }
 
 TimeEventsReader::TimeEventsReader(QObject *parent)
@@ -30,16 +65,34 @@ TimeEventsReader::TimeEventsReader(QObject *parent)
 {
     qRegisterMetaType<TimeEvent>("TimeEvent");
 
+    //Data is cleared before the reader pushes first events to the ingest
     connect(this, SIGNAL(started()),
-            MyInit::instance()->timeEvents(), SLOT(blockingClear()));
-    connect(this, SIGNAL(eventRead(TimeEvent)),
-            MyInit::instance()->timeEvents(), SLOT(blockingAddEvent(TimeEvent)));
-    connect(this, SIGNAL(finished()),
-            MyInit::instance()->timeEvents(), SLOT(blockingFlushTimeSlice()));
+            MyInit::instance()->timeEvents(), SLOT(blockingClear()), Qt::DirectConnection);
     connect(this, SIGNAL(objPropsRead(QVariantMap)),
             MyInit::instance()->timeEvents(), SLOT(blockingAddProps(QVariantMap)));
 }
 
+void TimeEventsReader::beginEvents()
+{
+    mBlock.clear();
+    mBlock.reserve(s_blockSize);
+    MyInit::instance()->ingest()->begin();
+}
+
+void TimeEventsReader::endEvents()
+{
+    MyInit::instance()->ingest()->push(mBlock);
+    mBlock.clear();
+    MyInit::instance()->ingest()->end();
+}
+
+void TimeEventsReader::pushBlock()
+{
+    MyInit::instance()->ingest()->push(mBlock);
+    mBlock.clear();
+    mBlock.reserve(s_blockSize);
+}
+
 
 RikenFileReader::RikenFileReader(QObject *parent)
     :
@@ -64,7 +117,7 @@ void RikenFileReader::close()
 //Last and middle bit set extraction
 #define LAST(k,n) ((k) & ((1<<(n))-1))
 #define MID(k,m,n) LAST((k)>>(m),((n)-(m)))
-void RikenFileReader::run()
+void RikenFileReader::read()
 {
     Q_EMIT started();
     QTextStream in(mFile.data());
@@ -73,9 +126,11 @@ void RikenFileReader::run()
     bool ok = true;
     QString line;
     size_t prevStartIdx = 0;
-    Q_EMIT eventRead(0); //add first start
-    while(!(line = in.readLine()).isNull() && ok)
+    beginEvents();
+    addEvent(0); //add first start
+    while(!isStopped() && !(line = in.readLine()).isNull() && ok)
     {
+        job()->setProgress(mFile->pos(), mFile->size());
         quint64 count = line.toULongLong(&ok, 16);
         size_t curStartIdx = MID(count, 32, 48);
         if(curStartIdx != prevStartIdx)
@@ -84,10 +139,11 @@ void RikenFileReader::run()
                                                                 curStartIdx + std::numeric_limits<uint16_t>::max() - prevStartIdx;
             prevStartIdx = curStartIdx;
             for(size_t i = 0; i < diffStartIdx; ++i)
-                Q_EMIT eventRead(0);
+                addEvent(0);
         }
-        Q_EMIT eventRead(MID(count, 4, 32));
+        addEvent(MID(count, 4, 32));
     }
+    endEvents();
     Q_EMIT finished();
 }
 
@@ -135,12 +191,14 @@ TxtFileReader::TxtFileReader(int scope, QObject *parent)
       mScope(scope)
 {
     Q_ASSERT(mScope >= 10);
+    //Data is cleared in the load task before reading starts
     connect
     (
         this,
         SIGNAL(started()),
         MyInit::instance()->timeEvents(),
-        SLOT(blockingClear())
+        SLOT(blockingClear()),
+        Qt::DirectConnection
     );
 }
 
@@ -154,7 +212,7 @@ void TxtFileReader::close()
     mFolderName.clear();
 }
 
-void TxtFileReader::run()
+void TxtFileReader::read()
 {
     Q_EMIT started();
     QDirIterator it(mFolderName);
@@ -182,6 +240,7 @@ void TxtFileReader::run()
             yMax = std::numeric_limits<double>::min();
     while(it.hasNext())
     {
+        job()->checkpoint();
         it.next();
         QFileInfo fileInfo = it.fileInfo();
         if(fileInfo.suffix() == "txt")
@@ -204,6 +263,8 @@ void TxtFileReader::run()
 
     for(size_t i = 0; i < mData.size(); ++i)
     {
+        job()->checkpoint();
+        job()->setProgress(static_cast<qint64>(i), static_cast<qint64>(mData.size()));
         MapUintUint ms;
         for(size_t j = 0; j < mData[i].size(); ++j)
         {
@@ -306,20 +367,23 @@ void RikenDataReader::close()
     mFile->close();
 }
 
-void RikenDataReader::run()
+void RikenDataReader::read()
 {
     Q_EMIT started();
     MyInit::instance()->massSpecColl()->setFileName(mFile->fileName());
     QTextStream stream(mFile.data());
 
-    Q_EMIT eventRead(0);
+    beginEvents();
+    addEvent(0);
     quint64 prevSweep = 0;
     while
     (
         stream.status() != QTextStream::ReadPastEnd
         && stream.status() != QTextStream::ReadCorruptData
+        && !isStopped()
     )
     {
+        job()->setProgress(mFile->pos(), mFile->size());
         quint64 chan, edge, tag, sweep, evt;
         stream >> chan >> edge >> tag >> sweep >> evt;
         if((m_bEdgeUp && edge == 1) || (m_bEdgeUp && edge == 0))
@@ -328,11 +392,12 @@ void RikenDataReader::run()
             {
                 quint64 diff = sweep > prevSweep ? sweep - prevSweep
                     : prevSweep + std::numeric_limits<uint16_t>::max() - sweep;
-                for(; diff != 0; diff--) Q_EMIT eventRead(0);
+                for(; diff != 0; diff--) addEvent(0);
             }
-            Q_EMIT eventRead(evt);
+            addEvent(evt);
         }
     }
+    endEvents();
     Q_EMIT finished();
 }
 
@@ -342,12 +407,14 @@ DirectMsFromRikenTxt::DirectMsFromRikenTxt(QObject *parent)
       m_bEdgeUp(true),
       mFile(new QFile)
 {
+    //Data is cleared in the load task before reading starts
     connect
     (
         this,
         SIGNAL(started()),
         MyInit::instance()->timeEvents(),
-        SLOT(blockingClear())
+        SLOT(blockingClear()),
+        Qt::DirectConnection
     );
 }
 
@@ -372,7 +439,7 @@ void DirectMsFromRikenTxt::close()
     mFile->close();
 }
 
-void DirectMsFromRikenTxt::run()
+void DirectMsFromRikenTxt::read()
 {
     Q_EMIT started();
 
@@ -397,9 +464,10 @@ void DirectMsFromRikenTxt::run()
     }
     stream.seek(0);
 
-    int step = nLines / 100;
     for(int i = 0; i < nLines; ++i)
     {
+        job()->checkpoint();
+        job()->setProgress(i, nLines);
         quint64 chan, edge, tag, sweep;
         int evt;
         stream >> chan >> edge >> tag >> sweep >> evt;
@@ -411,7 +479,6 @@ void DirectMsFromRikenTxt::run()
             {
                 ms.insert(it, {evt, 1});
             }
-            if(i % step == 0) Q_EMIT progressNotify((100 * i) / nLines);
         }
     }
     //Save virtual event with zero value
@@ -428,12 +495,14 @@ SPAMSHexinDataX32::SPAMSHexinDataX32(QObject *parent)
       Reader(parent),
       mProcess(new QProcess(this))
 {
+    //Data is cleared in the load task before reading starts
     connect
     (
         this,
         SIGNAL(started()),
         MyInit::instance()->timeEvents(),
-        SLOT(blockingClear())
+        SLOT(blockingClear()),
+        Qt::DirectConnection
     );
 }
 
@@ -480,7 +549,7 @@ void SPAMSHexinDataX32::close()
 {
 }
 
-void SPAMSHexinDataX32::run()
+void SPAMSHexinDataX32::read()
 {
     Q_EMIT started();
 
@@ -496,8 +565,9 @@ void SPAMSHexinDataX32::run()
 
 void SPAMSHexinDataX32::readChanel(int nChanel)
 {
+    //Collection is cleared by started(), so only new spectra get the type
     MyInit::instance()->massSpecColl()->setMsType(MassSpecImpl::MassSpecVecType);
-    QScopedPointer<PackProc> packer(new SimplePack<short>);
+    PackProc& packer = PackProc::shared<SimplePack<short>>();
     SimplePack<short>::Header h;
     QFile file("ms_out");
     file.open(QIODevice::ReadOnly);
@@ -510,8 +580,8 @@ void SPAMSHexinDataX32::readChanel(int nChanel)
     pos += sizeof (int);
     for(qulonglong i = 0; i < nMsNum; ++i)
     {
-        if(i%200 == 0)
-            Q_EMIT progress(static_cast<int>((i * 100) / nMsNum));
+        job()->checkpoint();
+        job()->setProgress(static_cast<qint64>(i), static_cast<qint64>(nMsNum));
         for(int i = 0; i != nChanel; ++i)
         {
             file.read(reinterpret_cast<char*>(&h), sizeof (SimplePack<short>::Header));
@@ -523,7 +593,7 @@ void SPAMSHexinDataX32::readChanel(int nChanel)
         file.seek(pos);
         PackProc::DataVec data(h.nBytes);
         file.read(data.data(), h.nBytes);
-        PackProc::DataVec unpackedData = packer->unpack(data);
+        PackProc::DataVec unpackedData = packer.unpack(data);
         SimplePack<short>::Array vals
         (
             reinterpret_cast<short*>(unpackedData.data()),
@@ -9,15 +9,20 @@
 
 #include "Data/TimeEvents.h"
 #include "Data/MassSpec.h"
+#include "Base/Job.h"
 
 /**
 	@class TimeEventsReader is an interface to read time events from file or etc.
+	Reading is run as a job: it stops at the next checkpoint after stop()
+	or cancellation of the job. Reader finishes only its own job, a job
+	passed by setJob is finished by its owner
 */
 class Reader: public QObject, public QRunnable
 {
 	Q_OBJECT
 
-    bool mStopFlag;
+    Job::Ptr mJob;
+    bool mOwnsJob;
 public:
 	Reader(QObject * parent = Q_NULLPTR);
 
@@ -27,12 +32,27 @@ public:
 
     virtual void close() = 0;
 
+    /**
+     * @brief run reads data within the reader job
+     */
+    void run() final;
+
+    const Job::Ptr& job() const;
+    void setJob(const Job::Ptr& job);
+
     Q_SIGNAL void objPropsRead(QVariantMap);
     Q_SIGNAL void started();
     Q_SIGNAL void finished();
-    Q_SIGNAL void progressNotify(int);
 
     Q_SLOT void stop();
+
+protected:
+    virtual void read() = 0;
+
+    inline bool isStopped() const
+    {
+        return mJob->isCancelled();
+    }
 };
 
 class QFile;
@@ -46,7 +66,28 @@ class TimeEventsReader : public Reader
 public:
     TimeEventsReader(QObject * parent = Q_NULLPTR);
 
-    Q_SIGNAL void eventRead(TimeEvent evt);
+protected:
+    //Events are passed to the ingest pipeline in blocks of this size
+    static const int s_blockSize = 1 << 16;
+
+    void beginEvents();
+
+    inline void addEvent(TimeEvent evt)
+    {
+        mBlock.push_back(evt);
+        if(mBlock.size() == s_blockSize) pushBlock();
+    }
+
+    /**
+     * @brief endEvents flushes the last time slice and waits until all
+     * mass spectra are published
+     */
+    void endEvents();
+
+private:
+    TimeEventsContainer mBlock;
+
+    void pushBlock();
 };
 
 class RikenFileReader : public TimeEventsReader
@@ -60,7 +101,7 @@ public:
 
     void close();
 
-    void run();
+    void read();
 
 private:
     QScopedPointer<QFile> mFile;
@@ -83,7 +124,7 @@ public:
 
     void close();
 
-    void run();
+    void read();
 
 private:
 
@@ -108,7 +149,7 @@ public:
 
     void close();
 
-    void run();
+    void read();
 
     Q_SIGNAL void massSpectrumReadNotify(MapUintUint);
 private:
@@ -138,7 +179,7 @@ public:
 
     void close();
 
-    void run();
+    void read();
 
     Q_SIGNAL void massSpectrumReadNotify(MapUintUint);
 private:
@@ -159,9 +200,7 @@ public:
 
     void close();
 
-    void run();
-
-    Q_SIGNAL void progress(int);
+    void read();
 private:
 
     enum ReadState
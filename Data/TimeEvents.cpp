@@ -1,5 +1,6 @@
 #include "Data/MassSpec.h"
 #include "Base/BaseObject.h"
+#include "Base/Job.h"
 #include "TimeEvents.h"
 
 TimeEvents::TimeEvents(QObject *parent)
@@ -33,6 +34,38 @@ void TimeEvents::blockingAddEvent(TimeEvent evt)
     }
 }
 
+QList<TimeEventsContainer> TimeEvents::blockingAddEvents
+(
+    const TimeEventsContainer &evts,
+    bool last
+)
+{
+    QList<TimeEventsContainer> res;
+    size_t n;
+    {
+        Locker lock(mMutex);
+        mTimeEvents.append(evts);
+        n = static_cast<size_t>(mTimeEvents.size());
+        for(TimeEvent evt : evts)
+        {
+            if(!evt && mStartsCount++ == mStartsPerHist)
+            {
+                mStartsCount = 1;
+                res.push_back(mTimeEventsSlice);
+                mTimeEventsSlice.clear();
+            }
+            mTimeEventsSlice.push_back(evt);
+        }
+        if(last && !mTimeEventsSlice.empty())
+        {
+            res.push_back(mTimeEventsSlice);
+            mTimeEventsSlice.clear();
+        }
+    }
+    Q_EMIT eventsUpdateNotify(n);
+    return res;
+}
+
 void TimeEvents::blockingAddProps(QVariantMap props)
 {
     Locker lock(mMutex);
@@ -78,10 +111,15 @@ void TimeEvents::recalculateTimeSlices(size_t startsPerHist)
             MyInit::instance()->massSpec()->blockingClear();
             mTimeEventsSlice.clear();
 
+            qint64 nDone = 0;
             for(TimeEvent evt : mTimeEvents)
             {
+                ++nDone;
                 if(!evt && mStartsCount++ == mStartsPerHist)
                 {
+                    //Job of the calling thread may stop recalculation here
+                    Job::check();
+                    Job::report(nDone, mTimeEvents.size());
                     mStartsCount = 1;
                     Q_EMIT sliceAccumulated(mTimeEventsSlice);
                     mTimeEventsSlice.clear();
@@ -72,13 +72,23 @@ public:
     Q_SIGNAL void recalculated();
 
     Q_SLOT void blockingAddEvent(TimeEvent);
+    /**
+     * @brief blockingAddEvents appends block of events and cuts time slices
+     * like blockingAddEvent does, but returns them instead of emitting
+     * sliceAccumulated
+     * @param evts
+     * @param last flushes incomplete slice at the end of data
+     * @return completed time slices
+     */
+    QList<TimeEventsContainer> blockingAddEvents(const TimeEventsContainer& evts, bool last);
     Q_SLOT void blockingAddProps(QVariantMap);
     Q_SLOT void blockingClear();
     Q_SLOT void flushTimeSlice();
     Q_SLOT void blockingFlushTimeSlice();
 
     /**
-     * @brief recalculateTimeSlices sets new starts count for accumulation and recalculates time slices
+     * @brief recalculateTimeSlices sets new starts count for accumulation and recalculates time slices.
+     * It can be cancelled by the job of the calling thread
      */
     Q_SLOT void recalculateTimeSlices(size_t);
 
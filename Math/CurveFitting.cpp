@@ -4,7 +4,11 @@
 #include <numeric>
 
 #include "CurveFitting.h"
+#include "MonteCarlo.h"
+#include "FisherInformation.h"
+#include "LevenbergMarquardt.h"
 #include "../Base/ThreadPool.h"
+#include "../Base/Job.h"
 #include "../QMapPropsDialog.h"
 #include "alglib/fasttransforms.h"
 
@@ -23,6 +27,132 @@ CurveFitting::Ptr CurveFitting::create(const QString &name, const DoubleVector &
     else return Ptr();
 }
 
+/**
+ * @brief shapeDerivatives calculates derivatives of shape values by its
+ * amplitude and position, the last one by central differences
+ * with step of one tenth of mean data spacing
+ */
+static void shapeDerivatives
+(
+    const InterpolatorFun& shape,
+    const std::vector<double>& x,
+    std::vector<double>& dAmp,
+    std::vector<double>& dPos
+)
+{
+    InterpolatorFun s(shape);
+    const double t = shape.peakPosition();
+    const double h = .1 * (x.back() - x.front()) / (x.size() - 1);
+    s.setPeakAmp(1.0);
+    dAmp = s.values(x);
+    s.setPeakAmp(shape.peakAmp());
+    s.setPeakPosition(t + h);
+    dPos = s.values(x);
+    s.setPeakPosition(t - h);
+    const std::vector<double> y = s.values(x);
+    for(size_t i = 0; i < x.size(); ++i)
+    {
+        dPos[i] = (dPos[i] - y[i]) / (2. * h);
+    }
+}
+
+/**
+ * @brief varProFit fits positions of shapes and, if fitWidth is set, their
+ * common width by Levenberg-Marquardt. Amplitudes are eliminated by linear
+ * least squares at every step (variable projection), residuals are
+ * weighted by s. Jacobian is the Kaufman approximation: derivatives of the
+ * model with fixed amplitudes projected out of the shapes span.
+ * On success shapes get fitted positions, width and amplitudes
+ */
+static bool varProFit
+(
+    const std::vector<InterpolatorFun*>& shapes,
+    const std::vector<double>& x,
+    const std::vector<double>& y,
+    const std::vector<double>& s,
+    bool fitWidth
+)
+{
+    const size_t n = shapes.size();
+    const size_t m = x.size();
+    const size_t nPars = fitWidth ? n + 1 : n;
+    //Position, width and amplitude to restore if fitting fails
+    std::vector<std::array<double, 3>> saved;
+    for(const InterpolatorFun* shape : shapes)
+    {
+        saved.push_back({shape->peakPosition(), shape->peakWidth(), shape->peakAmp()});
+    }
+    auto restore = [&]()->bool
+    {
+        for(size_t j = 0; j < n; ++j)
+        {
+            shapes[j]->setPeakPosition(saved[j][0]);
+            shapes[j]->setPeakWidth(saved[j][1]);
+            shapes[j]->setPeakAmp(saved[j][2]);
+        }
+        return false;
+    };
+    Eigen::VectorXd Y(m);
+    for(size_t i = 0; i < m; ++i) Y(i) = s[i] * y[i];
+    Eigen::MatrixXd Phi(m, n), dPhi(m, n);
+    Eigen::VectorXd amps;
+    std::vector<double> phi, dPos;
+    auto evaluate = [&](const std::vector<double>& p, std::vector<double>& r, std::vector<double>* jac)->bool
+    {
+        if(fitWidth && !(p[n] > 0.)) return false;
+        for(size_t j = 0; j < n; ++j)
+        {
+            shapes[j]->setPeakPosition(p[j]);
+            if(fitWidth) shapes[j]->setPeakWidth(p[n]);
+            shapes[j]->setPeakAmp(1.0);
+            shapeDerivatives(*shapes[j], x, phi, dPos);
+            for(size_t i = 0; i < m; ++i)
+            {
+                Phi(i, j) = s[i] * phi[i];
+                dPhi(i, j) = s[i] * dPos[i];
+            }
+            //Shape out of the data range can not be fitted
+            if(!(Phi.col(j).squaredNorm() > 0.)) return false;
+        }
+        const Eigen::ColPivHouseholderQR<Eigen::MatrixXd> qr(Phi);
+        amps = qr.solve(Y);
+        const Eigen::VectorXd R = Y - Phi * amps;
+        r.assign(R.data(), R.data() + m);
+        if(!jac) return true;
+        Eigen::MatrixXd V(m, nPars);
+        for(size_t j = 0; j < n; ++j) V.col(j) = amps(j) * dPhi.col(j);
+        if(fitWidth)
+        {
+            //Shape depends on (x - t) / w, so df/dw = df/dt * (x - t) / w
+            V.col(n).setZero();
+            for(size_t j = 0; j < n; ++j)
+                for(size_t i = 0; i < m; ++i)
+                    V(i, n) += V(i, j) * (x[i] - p[j]) / p[n];
+        }
+        const Eigen::MatrixXd J = Phi * qr.solve(V) - V;
+        jac->resize(m * nPars);
+        for(size_t i = 0; i < m; ++i)
+            for(size_t k = 0; k < nPars; ++k)
+                (*jac)[i * nPars + k] = J(i, k);
+        return true;
+    };
+    std::vector<double> p(nPars), r;
+    for(size_t j = 0; j < n; ++j) p[j] = shapes[j]->peakPosition();
+    if(fitWidth) p[n] = shapes.front()->peakWidth();
+    LevenbergMarquardt solver;
+    try
+    {
+        solver.minimize(evaluate, p);
+    }
+    catch (const std::runtime_error&)
+    {
+        return restore();
+    }
+    if(!evaluate(p, r, nullptr)) return restore();
+    for(size_t j = 0; j < n; ++j) shapes[j]->setPeakAmp(amps(j));
+    return true;
+}
+
 CurveFitting::CurveFitting(const DoubleVector &x, const DoubleVector &y)
 {
     Q_ASSERT(x.size() == y.size());
@@ -43,9 +173,10 @@ AsymmetricGaussian::AsymmetricGaussian
       CurveFitting (x, y),
       mParams(new Parameters(*other.mParams)),
       mErrors(new Errors(*other.mErrors)),
+      mFisherErrors(new Errors(*other.mFisherErrors)),
       mProps(new Properties(*other.mProps))
 {
-    run(x, y);
+    if(run(x, y) == 0.0) throw std::runtime_error("Refitting failed");
 }
 
 AsymmetricGaussian::AsymmetricGaussian
@@ -78,6 +209,7 @@ AsymmetricGaussian::AsymmetricGaussian
         QTextStream stream(&fitting);
         print(stream);
         stream << "sig = " << residuals(x, y) << "\n";
+        stream << "MC runs = " << mMonteCarlo.runsDone() << "\n";
         stream.flush();
         QMessageBox msg
         (
@@ -96,10 +228,56 @@ void AsymmetricGaussian::values
 ) const
 {
     y.resize(x.size());
-    ThreadPool::parFor(x.size(),[&](size_t i)
+    values(x.data(), y.data(), x.size());
+}
+
+void AsymmetricGaussian::values(const double *x, double *y, size_t n) const
+{
+    const size_t block = s_serialSize;
+    if(n <= block)
     {
-        y[i] = value(x[i]);
-    });
+        kernel(x, y, nullptr, n);
+        return;
+    }
+    ThreadPool::parFor
+    (
+        (n + block - 1) / block,
+        [&](size_t b)
+        {
+            const size_t first = b * block;
+            kernel(x + first, y + first, nullptr, std::min(block, n - first));
+        },
+        1
+    );
+}
+
+void AsymmetricGaussian::kernel(const double *x, double *y, double *jac, size_t n) const
+{
+    const double A = mParams->mA;
+    const double tc = mParams->mTc;
+    const double w = mParams->mW;
+    const double dxL = mParams->mDTL / w;
+    const double dxR = mParams->mDTR / w;
+    for(size_t i = 0; i < n; ++i)
+    {
+        //Exponent is the parabola clamped to [-dxL, dxR] continued by its
+        //tangents, so it equals -c * (dx - c / 2) with clamped c
+        const double dx = (x[i] - tc) / w;
+        const double c = std::min(std::max(dx, -dxL), dxR);
+        const double g = c * (.5 * c - dx);
+        const double e = std::exp(g);
+        y[i] = A * e;
+        if(jac)
+        {
+            const double f = A * e / w;
+            double * J = jac + 5 * i;
+            J[0] = e;
+            J[1] = std::min(dx + dxL, 0.) * f;
+            J[2] = std::min(dxR - dx, 0.) * f;
+            J[3] = c * f;
+            J[4] = -2. * g * f;
+        }
+    }
 }
 
 QString AsymmetricGaussian::eqn() const
@@ -150,14 +328,30 @@ CurveFitting::ParamsList AsymmetricGaussian::errors() const
     return errors;
 }
 
+CurveFitting::ParamsList AsymmetricGaussian::fisherErrors() const
+{
+    ParamsList errors
+    {
+        {"A", mFisherErrors->mA},
+        {"dtL", mFisherErrors->mDTL},
+        {"dtR", mFisherErrors->mDTR},
+        {"tc", mFisherErrors->mTc},
+        {"w", mFisherErrors->mW}
+    };
+    return errors;
+}
+
 CurveFitting::ParamsList AsymmetricGaussian::properties() const
 {
     ParamsList props
     {
         {"Init. step", mProps->mStep},
         {"Rel. tolerance", mProps->mRelTol},
-        {"Iter. num", mProps->mIterNum}
+        {"Iter. num", mProps->mIterNum},
+        {"Levenberg-Marquardt", static_cast<int>(mProps->mLevMar)},
+        {"Poisson weights", static_cast<int>(mProps->mPoissonWeights)}
     };
+    props.unite(mMonteCarlo.properties());
     return props;
 }
 
@@ -174,6 +368,11 @@ void AsymmetricGaussian::setProperties
         mProps->mRelTol = it.value().toDouble(&ok);
     if((it = props.find("Iter. num")) != props.end())
         mProps->mIterNum = it.value().toDouble(&ok);
+    if((it = props.find("Levenberg-Marquardt")) != props.end())
+        mProps->mLevMar = it.value().toInt(&ok) != 0;
+    if((it = props.find("Poisson weights")) != props.end())
+        mProps->mPoissonWeights = it.value().toInt(&ok) != 0;
+    mMonteCarlo.setProperties(props);
     Q_ASSERT(ok);
 }
 
@@ -182,17 +381,22 @@ void AsymmetricGaussian::print(QTextStream &out) const
     out << "Fitted with " << eqn() << "\n";
     QVariantMap pars = params();
     QVariantMap errs = errors();
+    QVariantMap fisherErrs = fisherErrors();
     out.setRealNumberPrecision(10);
     bool ok = true;
     for
     (
-        QVariantMap::ConstIterator itPars = pars.begin(), itErrs = errs.begin();
+        QVariantMap::ConstIterator
+            itPars = pars.begin(),
+            itErrs = errs.begin(),
+            itFisher = fisherErrs.begin();
         itPars != pars.end();
-        ++itPars, ++itErrs
+        ++itPars, ++itErrs, ++itFisher
     )
     {
         out << itPars.key() << " = " << itPars.value().toDouble(&ok)
-            << "+/-" << itErrs.value().toDouble(&ok) << "\n";
+            << "+/-" << itErrs.value().toDouble(&ok)
+            << " (Fisher: " << itFisher.value().toDouble(&ok) << ")\n";
     }
     Q_ASSERT(ok);
 }
@@ -213,6 +417,7 @@ double AsymmetricGaussian::run
     const DoubleVector &y
 )
 {
+    if(mProps->mLevMar) return runLevMar(x, y);
     double A;
     size_t iterNum = 0;
     try {
@@ -246,22 +451,72 @@ double AsymmetricGaussian::run
             && (++iterNum < mProps->mIterNum)
         );
     }
-    catch (const cv::Exception& ex)
+    catch (const cv::Exception&)
     {
-        QMessageBox::warning(Q_NULLPTR, QObject::tr("OpenCV exception handler"), QString("Exception") + ex.what());
+        //run is called from pool threads too, failure is reported by zero
+        //amplitude and the GUI constructor shows the message
         init(x, y);
+        return 0.0;
     }
     return A;
 }
 
+double AsymmetricGaussian::runLevMar
+(
+    const DoubleVector &x,
+    const DoubleVector &y
+)
+{
+    const size_t n = x.size();
+    DoubleVector s(n, 1.0);
+    if(mProps->mPoissonWeights)
+    {
+        for(size_t i = 0; i < n; ++i) s[i] = 1. / std::sqrt(std::max(y[i], 1.));
+    }
+    DoubleVector p{mParams->mA, mParams->mDTL, mParams->mDTR, mParams->mTc, mParams->mW};
+    LevenbergMarquardt solver(LevenbergMarquardt::s_defaultMaxIter, mProps->mRelTol);
+    try
+    {
+        solver.minimize
+        (
+            [&](const DoubleVector& pp, DoubleVector& r, DoubleVector* jac)->bool
+            {
+                if(!(pp[4] > 0.) || pp[1] < 0. || pp[2] < 0.) return false;
+                *mParams = {pp[0], pp[1], pp[2], pp[3], pp[4]};
+                r.resize(n);
+                if(jac) jac->resize(5 * n);
+                kernel(x.data(), r.data(), jac ? jac->data() : nullptr, n);
+                for(size_t i = 0; i < n; ++i)
+                {
+                    r[i] = s[i] * (y[i] - r[i]);
+                    if(!jac) continue;
+                    double * J = jac->data() + 5 * i;
+                    for(size_t k = 0; k < 5; ++k) J[k] *= - s[i];
+                }
+                return true;
+            },
+            p
+        );
+    }
+    catch (const std::runtime_error&)
+    {
+        init(x, y);
+        return 0.0;
+    }
+    *mParams = {p[0], p[1], p[2], p[3], p[4]};
+    return std::isfinite(mParams->mA) ? mParams->mA : 0.0;
+}
+
 void AsymmetricGaussian::init(const CurveFitting::DoubleVector &x, const CurveFitting::DoubleVector &y)
 {
     mParams.reset(new Parameters);
     mErrors.reset(new Errors);
+    mFisherErrors.reset(new Errors);
     mProps.reset(new Properties);
     *mParams = {1., 0., 0., 0., 0.};
     *mErrors = {0., 0., 0., 0., 0.};
-    *mProps = {0.25, 1e-6, 10};
+    *mFisherErrors = {0., 0., 0., 0., 0.};
+    *mProps = {0.25, 1e-6, 10, true, false};
     double norm = 0.0, xx = 0.0, xx2 = 0.0;
     for(size_t i = 0; i < x.size(); ++i)
     {
@@ -282,12 +537,36 @@ void AsymmetricGaussian::curveScaling(const CurveFitting::DoubleVector &x, const
     DoubleVector ty;
     mParams->mA = 1.0;
     values(x, ty);
-    double A = 0., norm = 0.;
-    for(size_t i = 0; i < x.size(); ++i)
+    using Sums = std::array<double, 2>;
+    auto term = [&](size_t i)->Sums
+    {
+        return Sums{y[i] * ty[i], ty[i] * ty[i]};
+    };
+    Sums s{0., 0.};
+    //Small curves are not worth a parallel dispatch
+    if(x.size() <= s_serialSize)
     {
-        A += y[i] * ty[i];
-        norm += ty[i] * ty[i];
+        for(size_t i = 0; i < x.size(); ++i)
+        {
+            const Sums t = term(i);
+            s[0] += t[0];
+            s[1] += t[1];
+        }
     }
+    else
+    {
+        s = ThreadPool::parReduce
+        (
+            x.size(),
+            s,
+            term,
+            [](const Sums& a, const Sums& b)->Sums
+            {
+                return Sums{a[0] + b[0], a[1] + b[1]};
+            }
+        );
+    }
+    const double A = s[0], norm = s[1];
     mParams->mA = std::isnormal(A / norm) ? A / norm : * std::max_element(y.begin(), y.end());
 }
 
@@ -296,39 +575,62 @@ void AsymmetricGaussian::estimateErrors
     const CurveFitting::DoubleVector &x
 )
 {
+    estimateFisherErrors(x);
+    if(mMonteCarlo.fastErrors())
+    {
+        *mErrors = *mFisherErrors;
+        return;
+    }
     try {
-        const size_t nRuns = 100;
-        DoubleVector y0;
-        values(x, y0);
-        DoubleVector  ty(y0.size());
-        std::poisson_distribution<> dist;
-        std::mt19937_64 gen;
-        double sig = 0.0;
-        for(size_t i = 0; i < nRuns; ++i)
-        {
-            for(size_t j = 0; j < y0.size(); ++j)
+        DoubleVector sig;
+        const bool done = Job::runModal
+        (
+            Q_NULLPTR,
+            QObject::tr("Estimating fit errors"),
+            [&]()->void
             {
-                if(y0[j] > 0.0)
-                {
-                    dist.param(std::poisson_distribution<>::param_type(y0[j]));
-                    ty[j] = dist(gen);
-                }
-                else
-                {
-                    ty[j] = 0.0;
-                }
+                sig = mMonteCarlo.run
+                (
+                    [&]()->DoubleVector
+                    {
+                        DoubleVector y0;
+                        values(x, y0);
+                        return y0;
+                    },
+                    [&](const DoubleVector& ty)->DoubleVector
+                    {
+                        AsymmetricGaussian gaus(x, ty, *this);
+                        return DoubleVector{mParams->mTc - gaus.mParams->mTc};
+                    }
+                );
             }
-            AsymmetricGaussian gaus(x, ty, *this);
-            double d = mParams->mTc - gaus.mParams->mTc;
-            sig += d * d;
-        }
-        sig /= nRuns;
-        mErrors->mTc = std::sqrt(sig);
+        );
+        if(!done) return;
+        mErrors->mTc = sig[0];
+    } catch (const Job::Cancelled&) {
+        throw;
     } catch (const std::exception& ex) {
         QMessageBox::warning(Q_NULLPTR, "std::exception handler", ex.what());
     }
 }
 
+void AsymmetricGaussian::estimateFisherErrors(const CurveFitting::DoubleVector &x)
+{
+    DoubleVector mu;
+    values(x, mu);
+    std::vector<DoubleVector> jac(5, DoubleVector(x.size()));
+    ThreadPool::parFor(x.size(), [&](size_t i)
+    {
+        jac[0][i] = dfdA(x[i]);
+        jac[1][i] = dfdtL(x[i]);
+        jac[2][i] = dfdtR(x[i]);
+        jac[3][i] = dfdtc(x[i]);
+        jac[4][i] = dfdw(x[i]);
+    });
+    const DoubleVector err = math::fisherErrors(mu, jac);
+    *mFisherErrors = {err[0], err[1], err[2], err[3], err[4]};
+}
+
 double AsymmetricGaussian::dfdA(double x) const
 {
     const double dx = (x - mParams->mTc) / mParams->mW;
@@ -395,13 +697,18 @@ double AsymmetricGaussian::residuals
     const CurveFitting::DoubleVector &y
 ) const
 {
-    double s = 0.;
     CurveFitting::DoubleVector yy;
     values(x, yy);
-    for(size_t i = 0; i < x.size(); ++i)
-    {
-        s += (y[i] - yy[i]) * (y[i] - yy[i]);
-    }
+    const double s = ThreadPool::parReduce
+    (
+        x.size(),
+        0.,
+        [&](size_t i)->double
+        {
+            return (y[i] - yy[i]) * (y[i] - yy[i]);
+        },
+        std::plus<double>()
+    );
     return s / (y.size() - 5);
 }
 
@@ -417,15 +724,20 @@ double AsymmetricGaussian::Function::calc(const double *x) const
     mObj->mParams->mDTL = x[2];
     mObj->mParams->mDTR = x[3];
     mObj->curveScaling(m_x, m_y);
-    double s = 0.;
-    DoubleVector yy;
+    DoubleVector& yy = m_yy;
     mObj->values(m_x, yy);
-    for (size_t i = 0; i < m_x.size(); ++i)
+    auto term = [&](size_t i)->double
     {
         double ds = yy[i] - m_y[i];
-        s += ds * ds;
+        return ds * ds;
+    };
+    if(m_x.size() <= s_serialSize)
+    {
+        double res = 0.;
+        for(size_t i = 0; i < m_x.size(); ++i) res += term(i);
+        return res;
     }
-    return s;
+    return ThreadPool::parReduce(m_x.size(), 0., term, std::plus<double>());
 }
 
 void AsymmetricGaussian::Function::getGradient(const double *x, double *y)
@@ -437,22 +749,31 @@ void AsymmetricGaussian::Function::getGradient(const double *x, double *y)
     mObj->curveScaling(m_x, m_y);
     DoubleVector yy;
     mObj->values(m_x, yy);
-    y[0] = 0.0;
-    y[1] = 0.0;
-    y[2] = 0.0;
-    y[3] = 0.0;
-    for(size_t i = 0; i < m_x.size(); ++i)
-    {
-        double d = yy[i] - m_y[i];
-        y[0] += d * mObj->dfdw(m_x[i]);
-        y[1] += d * mObj->dfdtc(m_x[i]);
-        y[2] += d * mObj->dfdtL(m_x[i]);
-        y[3] += d * mObj->dfdtR(m_x[i]);
-    }
-    y[0] *= 2.0;
-    y[1] *= 2.0;
-    y[2] *= 2.0;
-    y[3] *= 2.0;
+    using Grad = std::array<double, 4>;
+    const Grad g = ThreadPool::parReduce
+    (
+        m_x.size(),
+        Grad{0.0, 0.0, 0.0, 0.0},
+        [&](size_t i)->Grad
+        {
+            double d = yy[i] - m_y[i];
+            return Grad
+            {
+                d * mObj->dfdw(m_x[i]),
+                d * mObj->dfdtc(m_x[i]),
+                d * mObj->dfdtL(m_x[i]),
+                d * mObj->dfdtR(m_x[i])
+            };
+        },
+        [](const Grad& a, const Grad& b)->Grad
+        {
+            return Grad{a[0] + b[0], a[1] + b[1], a[2] + b[2], a[3] + b[3]};
+        }
+    );
+    y[0] = 2.0 * g[0];
+    y[1] = 2.0 * g[1];
+    y[2] = 2.0 * g[2];
+    y[3] = 2.0 * g[3];
 }
 
 Parabola::Parabola(const CurveFitting::DoubleVector &x, const CurveFitting::DoubleVector &y)
@@ -588,7 +909,8 @@ PeakShapeFit::PeakShapeFit(const CurveFitting::DoubleVector &x, const CurveFitti
       CurveFitting (x, y),
       mShape(new InterpolatorFun),
       mRelTol(1.e-9),
-      mPeakPositionUncertainty(0.0)
+      mPeakPositionUncertainty(0.0),
+      mPeakPositionFisherError(0.0)
 {
     double fPeakPosition = x[0] + maxPeakPos(y);
     DoubleVector tx = x;
@@ -597,7 +919,7 @@ PeakShapeFit::PeakShapeFit(const CurveFitting::DoubleVector &x, const CurveFitti
     mShape->setPeakAmp(1.0);
     mShape->setPeakWidth(1.0);
     mShape->setPeakPosition(fPeakPosition);
-    calculateUncertainty(x, 100);
+    calculateUncertainty(x);
 }
 
 void PeakShapeFit::values(const CurveFitting::DoubleVector &x, CurveFitting::DoubleVector &y) const
@@ -651,7 +973,9 @@ CurveFitting::ParamsList PeakShapeFit::errors() const
 
 CurveFitting::ParamsList PeakShapeFit::properties() const
 {
-    return ParamsList{ {"TOL", mRelTol} };
+    ParamsList props{ {"TOL", mRelTol} };
+    props.unite(mMonteCarlo.properties());
+    return props;
 }
 
 void PeakShapeFit::setProperties(const CurveFitting::ParamsList &props)
@@ -659,6 +983,7 @@ void PeakShapeFit::setProperties(const CurveFitting::ParamsList &props)
     ParamsList::ConstIterator it = props.find("TOL");
     bool ok = true;
     if(it != props.end()) mRelTol = it.value().toDouble(&ok);
+    mMonteCarlo.setProperties(props);
     Q_ASSERT(ok);
 }
 
@@ -679,6 +1004,7 @@ void PeakShapeFit::print(QTextStream &out) const
         out << itPars.key() << " = " << itPars.value().toDouble(&ok)
             << "+/-" << itErrs.value().toDouble(&ok) << "\n";
     }
+    out << "Position Fisher error = " << mPeakPositionFisherError << "\n";
     Q_ASSERT(ok);
 }
 
@@ -692,6 +1018,11 @@ double PeakShapeFit::peakPositionUncertainty() const
     return mPeakPositionUncertainty;
 }
 
+double PeakShapeFit::peakPositionFisherError() const
+{
+    return mPeakPositionFisherError;
+}
+
 void PeakShapeFit::fit(const CurveFitting::DoubleVector &x, const CurveFitting::DoubleVector &y)
 {
     QMapPropsDialog dialog;
@@ -715,7 +1046,7 @@ void PeakShapeFit::fit(const CurveFitting::DoubleVector &x, const CurveFitting::
     (
         cv::DownhillSolver::create
         (
-            cv::Ptr<Function>(new Function(this, x, y))
+            cv::Ptr<Function>(new Function(mShape.get(), x, y))
         )
     );
     cv::Mat_<double> step = 0.1 * res;
@@ -725,7 +1056,7 @@ void PeakShapeFit::fit(const CurveFitting::DoubleVector &x, const CurveFitting::
     solver->minimize(res);
     mShape->setPeakAmp(res(0));
     mShape->setPeakPosition(res(1));
-    calculateUncertainty(x, 100);
+    calculateUncertainty(x);
 }
 
 void PeakShapeFit::import(QTextStream &out) const
@@ -738,6 +1069,11 @@ InterpolatorFun PeakShapeFit::cloneShape() const
     return InterpolatorFun(*mShape);
 }
 
+const MonteCarlo &PeakShapeFit::monteCarlo() const
+{
+    return mMonteCarlo;
+}
+
 CurveFitting::DoubleVector PeakShapeFit::crossCorrelate
 (
     const DoubleVector &x,
@@ -892,37 +1228,27 @@ CurveFitting::DoubleVector PeakShapeFit::crossUncertainty
     const DoubleVector &peaks
 ) const
 {
-    DoubleVector res(peaks.size(), 0.0);
-    std::poisson_distribution<> dist;
-    std::mt19937_64 gen;
-    DoubleVector yy(y.size()), peaks1(peaks.size() * 10);
-    for(int i = 0; i < 100; ++i)
-    {
-        for(size_t i = 0; i < y.size(); ++i)
+    MonteCarlo monteCarlo(mMonteCarlo);
+    return monteCarlo.run
+    (
+        [&]()->DoubleVector
         {
-            if(y[i] > .0)
-            {
-                dist.param(std::poisson_distribution<>::param_type(y[i]));
-                yy[i] = dist(gen);
-            }
-            else
-            {
-                yy[i] = 0.0;
-            }
-        }
-        peaks1 = crossCorrPeaks(x, yy, peaks1.size());
-        DoubleVector::iterator it = peaks1.begin();
-        for(size_t j = 0; j < peaks.size(); ++j)
+            return y;
+        },
+        [&](const DoubleVector& yy)->DoubleVector
         {
-            it = std::lower_bound(it, peaks1.end(), peaks[j]);
-            double p1;
-            if(it == peaks.end())
+            DoubleVector res(peaks.size());
+            DoubleVector peaks1 = crossCorrPeaks(x, yy, static_cast<int>(peaks.size() * 10));
+            DoubleVector::iterator it = peaks1.begin();
+            for(size_t j = 0; j < peaks.size(); ++j)
             {
-                p1 = *std::prev(it);
-            }
-            else
-            {
-                if(peaks[j] - *std::prev(it) < *it - peaks[j])
+                it = std::lower_bound(it, peaks1.end(), peaks[j]);
+                double p1;
+                if(it == peaks1.end())
+                {
+                    p1 = *std::prev(it);
+                }
+                else if(it != peaks1.begin() && peaks[j] - *std::prev(it) < *it - peaks[j])
                 {
                     p1 = *std::prev(it);
                     --it;
@@ -931,13 +1257,11 @@ CurveFitting::DoubleVector PeakShapeFit::crossUncertainty
                 {
                     p1 = *it;
                 }
+                res[j] = p1 - peaks[j];
             }
-            const double d = p1 - peaks[j];
-            res[j] += d*d;
+            return res;
         }
-    }
-    for(size_t j = 0; j < peaks.size(); ++j) res[j] = std::sqrt(res[j]/100);
-    return res;
+    );
 }
 
 double PeakShapeFit::maxPeakPos(const CurveFitting::DoubleVector &y)
@@ -949,49 +1273,49 @@ double PeakShapeFit::maxPeakPos(const CurveFitting::DoubleVector &y)
     return static_cast<double>(n) - b / 2 / a;
 }
 
-void PeakShapeFit::calculateUncertainty(const DoubleVector& vXVals, const int nRuns)
+void PeakShapeFit::calculateUncertainty(const DoubleVector& vXVals)
 {
-    double fPeakPosition = mShape->peakPosition();
-    double fAmp = mShape->peakAmp();
-    DoubleVector y = mShape->values(vXVals), ty(y.size());
-    std::poisson_distribution<> dist;
-    std::mt19937_64 gen;
-    double s = 0.0;
-    for(int i = 0; i < nRuns; ++i)
+    DoubleVector dAmp, dPos;
+    shapeDerivatives(*mShape, vXVals, dAmp, dPos);
+    mPeakPositionFisherError = math::fisherErrors
+    (
+        mShape->values(vXVals),
+        std::vector<DoubleVector>{dAmp, dPos}
+    )[1];
+    if(mMonteCarlo.fastErrors())
     {
-        for(size_t j = 0; j < y.size(); ++j)
+        mPeakPositionUncertainty = mPeakPositionFisherError;
+        return;
+    }
+    const double fPeakPosition = mShape->peakPosition();
+    const double fAmp = mShape->peakAmp();
+    mPeakPositionUncertainty = mMonteCarlo.run
+    (
+        [&]()->DoubleVector
         {
-            if(y[j] > 0.0)
-            {
-                dist.param(std::poisson_distribution<>::param_type(y[j]));
-                ty[j] = dist(gen);
-            }
-            else
-            {
-                ty[j] = 0.0;
-            }
-        }
-        cv::Mat_<double> res(2,1);
-        res << mShape->peakAmp(), fPeakPosition;
-        cv::Ptr<cv::DownhillSolver> solver
-        (
-            cv::DownhillSolver::create
+            return mShape->values(vXVals);
+        },
+        [&](const DoubleVector& ty)->DoubleVector
+        {
+            //Every replicate moves its own copy of the shape
+            InterpolatorFun shape(*mShape);
+            cv::Mat_<double> res(2,1);
+            res << fAmp, fPeakPosition;
+            cv::Ptr<cv::DownhillSolver> solver
             (
-                cv::Ptr<Function>(new Function(this, vXVals, ty))
-            )
-        );
-        cv::Mat_<double> step = 0.1 * res;
-        step(1) = 1;
-        solver->setInitStep(step);
-        solver->setTermCriteria(cv::TermCriteria(3, 10000, mRelTol));
-        solver->minimize(res);
-
-        double d = res(1) - fPeakPosition;
-        s += d*d;
-    }
-    mPeakPositionUncertainty = std::sqrt(s/nRuns);
-    mShape->setPeakAmp(fAmp);
-    mShape->setPeakPosition(fPeakPosition);
+                cv::DownhillSolver::create
+                (
+                    cv::Ptr<Function>(new Function(&shape, vXVals, ty))
+                )
+            );
+            cv::Mat_<double> step = 0.1 * res;
+            step(1) = 1;
+            solver->setInitStep(step);
+            solver->setTermCriteria(cv::TermCriteria(3, 10000, mRelTol));
+            solver->minimize(res);
+            return DoubleVector{res(1) - fPeakPosition};
+        }
+    )[0];
 }
 
 int PeakShapeFit::Function::getDims() const
@@ -1002,10 +1326,9 @@ int PeakShapeFit::Function::getDims() const
 double PeakShapeFit::Function::calc(const double *x) const
 {
     double ss = 0.0;
-    DoubleVector yy(m_x.size());
-    mObj->mShape->setPeakAmp(x[0]);
-    mObj->mShape->setPeakPosition(x[1]);
-    mObj->values(m_x, yy);
+    mShape->setPeakAmp(x[0]);
+    mShape->setPeakPosition(x[1]);
+    const DoubleVector yy = mShape->values(m_x);
     for (size_t i = 0; i < m_x.size(); ++i)
     {
         double ds = (m_y[i] - yy[i]);
@@ -1019,7 +1342,10 @@ DoublePeakShapeFit::DoublePeakShapeFit(const PeakShapeFit &onePeakShape, const D
       mShape1(new InterpolatorFun(onePeakShape.cloneShape())),
       mShape2(new InterpolatorFun(onePeakShape.cloneShape())),
       mPeakPositionUncertainty1(0.0),
-      mPeakPositionUncertainty2(0.0)
+      mPeakPositionUncertainty2(0.0),
+      mPeakPositionFisherError1(0.0),
+      mPeakPositionFisherError2(0.0),
+      mMonteCarlo(onePeakShape.monteCarlo())
 {
     QMapPropsDialog dialog;
     QVariantMap props{{"t1: ", .0}, {"t2: ", .0}};
@@ -1035,6 +1361,18 @@ DoublePeakShapeFit::DoublePeakShapeFit(const PeakShapeFit &onePeakShape, const D
     fit(x, y);
 }
 
+DoublePeakShapeFit::DoublePeakShapeFit(const DoublePeakShapeFit &other)
+    :
+      mShape1(new InterpolatorFun(*other.mShape1)),
+      mShape2(new InterpolatorFun(*other.mShape2)),
+      mPeakPositionUncertainty1(other.mPeakPositionUncertainty1),
+      mPeakPositionUncertainty2(other.mPeakPositionUncertainty2),
+      mPeakPositionFisherError1(other.mPeakPositionFisherError1),
+      mPeakPositionFisherError2(other.mPeakPositionFisherError2),
+      mMonteCarlo(other.mMonteCarlo)
+{
+}
+
 void DoublePeakShapeFit::values(const DoublePeakShapeFit::DoubleVector &x, DoublePeakShapeFit::DoubleVector &y) const
 {
     y = mShape1->values(x);
@@ -1046,40 +1384,34 @@ void DoublePeakShapeFit::fit(const DoubleVector& x, const DoubleVector& y)
 {
     mPeakPositionUncertainty1 = 0.0;
     mPeakPositionUncertainty2 = 0.0;
-    cv::Mat_<double> p0{mShape1->peakPosition(), mShape2->peakPosition()};
-    minimize(p0, p0, Function(this, x, y));
-    mShape1->setPeakPosition(p0(0));
-    mShape2->setPeakPosition(p0(1));
+    minimize(x, y);
     calcAmps(x, y);
-    DoubleVector yy;
-    values(x, yy);
-    DoubleVector ty(y.size());
-    std::poisson_distribution<> dist;
-    std::mt19937_64 gen;
-    double fMax1 = p0(0); double fMax2 = p0(1);
-    for(int i = 0; i < 100; ++i)
-    {
-        p0 = cv::Mat_<double>{fMax1, fMax2};
-        for(size_t j = 0; j < yy.size(); ++j)
+    estimateFisherErrors(x);
+    if(mMonteCarlo.fastErrors())
+    {
+        mPeakPositionUncertainty1 = mPeakPositionFisherError1;
+        mPeakPositionUncertainty2 = mPeakPositionFisherError2;
+        return;
+    }
+    const double fMax1 = peakPosition1(), fMax2 = peakPosition2();
+    const DoubleVector sig = mMonteCarlo.run
+    (
+        [&]()->DoubleVector
         {
-            if(yy[j] > 0.)
-            {
-                dist.param(std::poisson_distribution<>::param_type(yy[j]));
-                ty[j] = dist(gen);
-            }
-            else
-            {
-                ty[j] = 0.;
-            }
+            DoubleVector yy;
+            values(x, yy);
+            return yy;
+        },
+        [&](const DoubleVector& ty)->DoubleVector
+        {
+            //Fit function changes shapes, so every replicate has its own ones
+            DoublePeakShapeFit replicate(*this);
+            replicate.minimize(x, ty);
+            return DoubleVector{fMax1 - replicate.peakPosition1(), fMax2 - replicate.peakPosition2()};
         }
-        minimize(p0, p0, Function(this, x, ty));
-        double dp1 = fMax1 - p0(0);
-        mPeakPositionUncertainty1 += dp1 * dp1;
-        double dp2 = fMax2 - p0(1);
-        mPeakPositionUncertainty2 += dp2 * dp2;
-    }
-    mPeakPositionUncertainty1 = std::sqrt(mPeakPositionUncertainty1 / 100);
-    mPeakPositionUncertainty2 = std::sqrt(mPeakPositionUncertainty2 / 100);
+    );
+    mPeakPositionUncertainty1 = sig[0];
+    mPeakPositionUncertainty2 = sig[1];
 }
 
 double DoublePeakShapeFit::peakPositionUncertainty2() const
@@ -1092,20 +1424,20 @@ double DoublePeakShapeFit::peakPositionUncertainty1() const
     return mPeakPositionUncertainty1;
 }
 
-void DoublePeakShapeFit::minimize(const cv::Mat_<double> &p0, cv::Mat_<double> &p1, const Function &fun)
+double DoublePeakShapeFit::peakPositionFisherError1() const
 {
-    cv::Ptr<cv::DownhillSolver> solver
-    (
-        cv::DownhillSolver::create
-        (
-            cv::Ptr<Function>(new Function(fun))
-        )
-    );
-    p1 = p0;
-    cv::Mat_<double> step{.1, .1};
-    solver->setInitStep(step);
-    solver->setTermCriteria(cv::TermCriteria(3, 10000, 1e-9));
-    solver->minimize(p1);
+    return mPeakPositionFisherError1;
+}
+
+double DoublePeakShapeFit::peakPositionFisherError2() const
+{
+    return mPeakPositionFisherError2;
+}
+
+void DoublePeakShapeFit::minimize(const DoubleVector &x, const DoubleVector &y)
+{
+    //Amplitudes are linear, so only positions are optimized
+    varProFit({mShape1.get(), mShape2.get()}, x, y, DoubleVector(x.size(), 1.0), false);
 }
 
 void DoublePeakShapeFit::calcAmps(const DoubleVector &x, const DoubleVector &y)
@@ -1128,25 +1460,17 @@ void DoublePeakShapeFit::calcAmps(const DoubleVector &x, const DoubleVector &y)
     mShape2->setPeakAmp(mShape2->peakAmp() * A(1));
 }
 
-int DoublePeakShapeFit::Function::getDims() const
+void DoublePeakShapeFit::estimateFisherErrors(const DoubleVector &x)
 {
-    return 2;
-}
-
-double DoublePeakShapeFit::Function::calc(const double *x) const
-{
-    double ss = 0.0;
-    DoubleVector yy(m_x.size());
-    mObj->mShape1->setPeakPosition(x[0]);
-    mObj->mShape2->setPeakPosition(x[1]);
-    mObj->calcAmps(m_x, m_y);
-    mObj->values(m_x, yy);
-    for (size_t i = 0; i < m_x.size(); ++i)
-    {
-        double ds = (m_y[i] - yy[i]);
-        ss += ds * ds;
-    }
-    return ss;
+    //Amplitudes are fitted too, so they are kept in the information matrix
+    std::vector<DoubleVector> jac(4);
+    shapeDerivatives(*mShape1, x, jac[0], jac[2]);
+    shapeDerivatives(*mShape2, x, jac[1], jac[3]);
+    DoubleVector mu;
+    values(x, mu);
+    const DoubleVector err = math::fisherErrors(mu, jac);
+    mPeakPositionFisherError1 = err[2];
+    mPeakPositionFisherError2 = err[3];
 }
 
 MultiShapeFit::MultiShapeFit
@@ -1158,7 +1482,9 @@ MultiShapeFit::MultiShapeFit
 )
     :
       mShapes(nShapes),
-      mUncertainties(nShapes)
+      mUncertainties(nShapes),
+      mFisherErrors(nShapes),
+      mMonteCarlo(onePeakShape.monteCarlo())
 {
     QVariantMap props;
     for(size_t i = 0; i < nShapes; ++i)
@@ -1178,6 +1504,20 @@ MultiShapeFit::MultiShapeFit
     if(calcAmps(x, y)) fit(x, y);
 }
 
+MultiShapeFit::MultiShapeFit(const MultiShapeFit &other)
+    :
+      mShapes(other.mShapes.size()),
+      mW(other.mW),
+      mUncertainties(other.mUncertainties),
+      mFisherErrors(other.mFisherErrors),
+      mMonteCarlo(other.mMonteCarlo)
+{
+    for(size_t i = 0; i < mShapes.size(); ++i)
+    {
+        mShapes[i].reset(new InterpolatorFun(*other.mShapes[i]));
+    }
+}
+
 void MultiShapeFit::values
 (
     const DoubleVector &x,
@@ -1209,46 +1549,35 @@ double MultiShapeFit::value(double x) const
 void MultiShapeFit::fit(const MultiShapeFit::DoubleVector &x, const MultiShapeFit::DoubleVector &y)
 {
     mUncertainties.assign(mUncertainties.size(), 0.0);
-    minimize(Function(this, x, y));
-    std::poisson_distribution<> dist;
-    std::mt19937_64 gen;
-    DoubleVector tp(mShapes.size()), tA(mShapes.size());
-    for(size_t i = 0; i < mShapes.size(); ++i)
+    minimize(x, y);
+    estimateFisherErrors(x);
+    if(mMonteCarlo.fastErrors())
     {
-        tp[i] = mShapes[i]->peakPosition();
-        tA[i] = mShapes[i]->peakAmp();
+        mUncertainties = mFisherErrors;
+        calcAmps(x, y);
+        return;
     }
-    double tw = mW;
-    DoubleVector yy(x.size()), ty(yy.size());
-    for(int i = 0; i < 100; ++i)
-    {
-        values(x, yy);
-        for(size_t j = 0; j < x.size(); ++j)
+    mUncertainties = mMonteCarlo.run
+    (
+        [&]()->DoubleVector
         {
-            if(yy[j] > 0.)
-            {
-                dist.param(std::poisson_distribution<>::param_type(yy[j]));
-                ty[j] = dist(gen);
-            }
-            else
+            DoubleVector yy;
+            values(x, yy);
+            return yy;
+        },
+        [&](const DoubleVector& ty)->DoubleVector
+        {
+            //Fit function changes shapes, so every replicate has its own ones
+            MultiShapeFit replicate(*this);
+            replicate.minimize(x, ty);
+            DoubleVector d(mShapes.size());
+            for(size_t j = 0; j < mShapes.size(); ++j)
             {
-                ty[j] = .0;
+                d[j] = mShapes[j]->peakPosition() - replicate.mShapes[j]->peakPosition();
             }
+            return d;
         }
-        minimize(Function(this, x, ty));
-        for(size_t j = 0; j < mShapes.size(); ++j)
-        {
-            const double d = tp[j] - mShapes[j]->peakPosition();
-            mUncertainties[j] += d*d;
-            mShapes[j]->setPeakPosition(tp[j]);
-            mShapes[j]->setPeakAmp(tA[j]);
-        }
-        setWidth(tw);
-    }
-    for(double& u : mUncertainties)
-    {
-        u = std::sqrt(u / 100);
-    }
+    );
     calcAmps(x, y);
 }
 
@@ -1259,41 +1588,28 @@ void MultiShapeFit::importData(QTextStream &out) const
         out.setRealNumberPrecision(10);
         out << mShapes[i]->peakPosition() / 10. << "\t";
         out.setRealNumberPrecision(3);
-        out << mUncertainties[i] / 10. << "\n";
+        out << mUncertainties[i] / 10. << "\t";
+        out << mFisherErrors[i] / 10. << "\n";
     }
 }
 
-void MultiShapeFit::minimize(const MultiShapeFit::Function &fun)
+void MultiShapeFit::minimize(const DoubleVector &x, const DoubleVector &y)
 {
-    cv::Ptr<cv::DownhillSolver> solver
-    (
-        cv::DownhillSolver::create
-        (
-            cv::Ptr<Function>(new Function(fun))
-        )
-    );
-    cv::Mat_<double> p0(2*mShapes.size() + 1, 1);
-    for(size_t i = 0; i < mShapes.size(); ++i)
+    //Amplitudes are linear, so only positions and width are optimized.
+    //Poisson weights are taken from data
+    DoubleVector s(y.size());
+    for(size_t i = 0; i < y.size(); ++i)
     {
-        p0(i, 0) = mShapes[i]->peakPosition();
-        p0(i + mShapes.size(), 0) = mShapes[i]->peakAmp();
+        s[i] = 1. / std::sqrt(std::max(y[i], 0.) + 1.);
     }
-    p0(2*mShapes.size(), 0) = mW;
-    cv::Mat_<double> step(2*mShapes.size() + 1, 1);
+    std::vector<InterpolatorFun*> shapes(mShapes.size());
     for(size_t i = 0; i < mShapes.size(); ++i)
     {
-        step(i, 0) = 0.1;
-        step(i + mShapes.size(), 0) = 0.01 * mShapes[i]->peakAmp();
+        shapes[i] = mShapes[i].get();
     }
-    step(2 * mShapes.size(), 0) = 0.01 * mW;
-    solver->setInitStep(step);
-    solver->setTermCriteria(cv::TermCriteria(3, 1000, 1e-9));
-    solver->minimize(p0);
-    setWidth(p0(2*mShapes.size(), 0));
-    for(size_t i = 0; i < mShapes.size(); ++i)
+    if(varProFit(shapes, x, y, s, true))
     {
-        mShapes[i]->setPeakPosition(p0(i, 0));
-        mShapes[i]->setPeakAmp(p0(i + mShapes.size(), 0));
+        mW = mShapes.front()->peakWidth();
     }
 }
 
@@ -1335,25 +1651,26 @@ bool MultiShapeFit::calcAmps
     return std::all_of(mShapes.begin(), mShapes.end(), [](const auto& p)->bool{ return p->peakAmp() > 0.; });
 }
 
-int MultiShapeFit::Function::getDims() const
+void MultiShapeFit::estimateFisherErrors(const DoubleVector &x)
 {
-    return 2 * mObj->mShapes.size() + 1;
-}
-
-double MultiShapeFit::Function::calc(const double *x) const
-{
-    for(size_t i = 0; i < mObj->mShapes.size(); ++i)
-    {
-        mObj->mShapes[i]->setPeakPosition(x[i]);
-        mObj->mShapes[i]->setPeakAmp(x[i + mObj->mShapes.size()]);
-    }
-    mObj->setWidth(x[2*mObj->mShapes.size()]);
-    double s = 0.;
-    for(size_t i = 0; i < m_x.size(); ++i)
+    //Parameters are ordered as in minimize: positions, amplitudes and width
+    const size_t n = mShapes.size();
+    std::vector<DoubleVector> jac(2 * n + 1);
+    DoubleVector& dW = jac[2 * n];
+    dW.assign(x.size(), 0.0);
+    for(size_t j = 0; j < n; ++j)
     {
-        const double y0 = mObj->value(m_x[i]);
-        const double ds = (m_y[i] - y0);
-        s += ds * ds / (y0 + 1.);
+        shapeDerivatives(*mShapes[j], x, jac[j + n], jac[j]);
+        //Shape depends on (x - t) / w, so df/dw = df/dt * (x - t) / w
+        const double t = mShapes[j]->peakPosition();
+        for(size_t i = 0; i < x.size(); ++i)
+        {
+            dW[i] += jac[j][i] * (x[i] - t) / mW;
+        }
     }
-    return s;
+    DoubleVector mu;
+    values(x, mu);
+    const DoubleVector err = math::fisherErrors(mu, jac);
+    mFisherErrors.assign(err.begin(), err.begin() + n);
 }
+
@@ -9,6 +9,7 @@
 #include <QMap>
 #include <opencv2/core/core.hpp>
 #include "Math/peakparams.h"
+#include "Math/MonteCarlo.h"
 #include "../Data/PeakShape.h"
 
 class CurveFitting : public PeakParams
@@ -76,6 +77,10 @@ class AsymmetricGaussian : public CurveFitting
         double mStep;
         double mRelTol;
         double mIterNum;
+        //Levenberg-Marquardt engine instead of simplex
+        bool mLevMar;
+        //Residuals are weighted by Poisson sigma of counts
+        bool mPoissonWeights;
     };
 
     class Function : public cv::MinProblemSolver::Function
@@ -83,6 +88,8 @@ class AsymmetricGaussian : public CurveFitting
         mutable AsymmetricGaussian * mObj;
         const DoubleVector& m_x;
         const DoubleVector& m_y;
+        //Model values reused between evaluations
+        mutable DoubleVector m_yy;
     public:
         Function
         (
@@ -106,6 +113,10 @@ class AsymmetricGaussian : public CurveFitting
 
     using Errors = Parameters;
 
+    /**
+     * @brief AsymmetricGaussian refits y starting from other, throws
+     * std::runtime_error if fitting failed
+     */
     AsymmetricGaussian
     (
         const DoubleVector& x,
@@ -118,12 +129,25 @@ public:
 
     virtual void values(const DoubleVector& x, DoubleVector& y) const;
 
+    /**
+     * @brief values evaluates curve into caller provided buffer, arrays
+     * longer than s_serialSize are split between threads
+     */
+    void values(const double * x, double * y, size_t n) const;
+
+    static const size_t s_serialSize = 4096;
+
     QString eqn() const;
 
     ParamsList params() const;
     void setParams(const ParamsList &params);
     ParamsList errors() const;
 
+    /**
+     * @brief fisherErrors parameter errors from Fisher information
+     */
+    ParamsList fisherErrors() const;
+
     ParamsList properties() const;
     void setProperties(const ParamsList& props);
 
@@ -137,14 +161,34 @@ private:
 
     QScopedPointer<Parameters> mParams;
     QScopedPointer<Errors> mErrors;
+    QScopedPointer<Errors> mFisherErrors;
     QScopedPointer<Properties> mProps;
+    MonteCarlo mMonteCarlo;
 
+    /**
+     * @brief run fits parameters, it is called from pool threads as well
+     * so errors are not shown here
+     * @return fitted amplitude or zero if fitting failed
+     */
     double run(const DoubleVector& x, const DoubleVector& y);
 
+    /**
+     * @brief runLevMar fits all parameters at once using analytic Jacobian
+     * @return fitted amplitude or zero if fitting failed
+     */
+    double runLevMar(const DoubleVector& x, const DoubleVector& y);
+
     void init(const DoubleVector& x, const DoubleVector& y);
 
     inline double value(double x) const;
 
+    /**
+     * @brief kernel evaluates curve without branches, one exponent per point.
+     * If jac is not null it gets derivatives by A, dtL, dtR, tc and w of
+     * every point in row major order
+     */
+    void kernel(const double * x, double * y, double * jac, size_t n) const;
+
     /**
      * @brief curveScaling recalculates curve scaling factor
      */
@@ -152,6 +196,8 @@ private:
 
     void estimateErrors(const DoubleVector& x);
 
+    void estimateFisherErrors(const DoubleVector& x);
+
     //Derivatives of function by its parameters
     double dfdA(double x) const;
     double dfdw(double x) const;
@@ -201,19 +247,19 @@ class PeakShapeFit : public CurveFitting
     std::unique_ptr<InterpolatorFun> mShape;
     class Function : public cv::MinProblemSolver::Function
     {
-        mutable PeakShapeFit * mObj;
+        InterpolatorFun * mShape;
         const DoubleVector& m_x;
         const DoubleVector& m_y;
     public:
         Function
         (
-            PeakShapeFit * obj,
+            InterpolatorFun * shape,
             const DoubleVector& x,
             const DoubleVector& y
         )
             :
               cv::MinProblemSolver::Function(),
-              mObj(obj),
+              mShape(shape),
               m_x(x),
               m_y(y)
         {
@@ -242,6 +288,11 @@ public:
     double peakPosition() const;
     double peakPositionUncertainty() const;
 
+    /**
+     * @brief peakPositionFisherError peak position error from Fisher information
+     */
+    double peakPositionFisherError() const;
+
     /**
      * @brief fits shape to a new data
      * @param x
@@ -257,6 +308,11 @@ public:
 
     InterpolatorFun cloneShape() const;
 
+    /**
+     * @brief monteCarlo uncertainty estimator set by properties
+     */
+    const MonteCarlo& monteCarlo() const;
+
     /**
      * @brief crossCorrelate estimates peak shape cross-correlation
      * @param x
@@ -296,9 +352,11 @@ public:
     ) const;
 private:
     static double maxPeakPos(const DoubleVector& y);
-    void calculateUncertainty(const DoubleVector &vXVals, const int nRuns);
+    void calculateUncertainty(const DoubleVector &vXVals);
     double mRelTol;
     double mPeakPositionUncertainty;
+    double mPeakPositionFisherError;
+    MonteCarlo mMonteCarlo;
 };
 
 /**
@@ -308,32 +366,7 @@ class DoublePeakShapeFit
 {
 public:
     using DoubleVector = std::vector<double>;
-private:
-    class Function : public cv::MinProblemSolver::Function
-    {
-        mutable DoublePeakShapeFit * mObj;
-        const DoubleVector& m_x;
-        const DoubleVector& m_y;
-        double mMaxY;
-    public:
-        Function
-        (
-            DoublePeakShapeFit * obj,
-            const DoubleVector& x,
-            const DoubleVector& y
-        )
-            :
-              cv::MinProblemSolver::Function(),
-              mObj(obj),
-              m_x(x),
-              m_y(y)
-        {
-        }
 
-        int getDims() const;
-        double calc(const double* x) const;
-    };
-public:
     DoublePeakShapeFit(const PeakShapeFit& onePeakShape, const DoubleVector &x, const DoubleVector &y);
 
     void values(const DoubleVector& x, DoubleVector& y) const;
@@ -348,13 +381,27 @@ public:
 
     double peakPositionUncertainty1() const;
 
+    /**
+     * @brief Peak position errors from Fisher information
+     */
+    double peakPositionFisherError1() const;
+    double peakPositionFisherError2() const;
+
 private:
     std::unique_ptr<InterpolatorFun> mShape1, mShape2;
     double mPeakPositionUncertainty1, mPeakPositionUncertainty2;
+    double mPeakPositionFisherError1, mPeakPositionFisherError2;
+    MonteCarlo mMonteCarlo;
 
-    void minimize(const cv::Mat_<double>& p0, cv::Mat_<double>& p1, const Function& fun);
+    //Copies shapes, used for independent refits
+    DoublePeakShapeFit(const DoublePeakShapeFit& other);
+
+    //Fits peak positions to y starting from the current ones
+    void minimize(const DoubleVector& x, const DoubleVector& y);
 
     void calcAmps(const DoubleVector& x, const DoubleVector& y);
+
+    void estimateFisherErrors(const DoubleVector& x);
 };
 
 class MultiShapeFit
@@ -362,35 +409,6 @@ class MultiShapeFit
 public:
     using DoubleVector = DoublePeakShapeFit::DoubleVector;
 
-private:
-    class Function : public cv::MinProblemSolver::Function
-    {
-        mutable MultiShapeFit * mObj;
-        const DoubleVector& m_x;
-        const DoubleVector& m_y;
-        double mMaxY;
-    public:
-        Function
-        (
-            MultiShapeFit * obj,
-            const DoubleVector& x,
-            const DoubleVector& y
-        )
-            :
-              cv::MinProblemSolver::Function(),
-              mObj(obj),
-              m_x(x),
-              m_y(y)
-        {
-        }
-
-        int getDims() const;
-        double calc(const double* x) const;
-
-        const DoubleVector& xVals() const { return m_x; }
-        const DoubleVector& yVals() const { return m_y; }
-    };
-public:
     MultiShapeFit
     (
         const PeakShapeFit& onePeakShape,
@@ -405,18 +423,30 @@ public:
 
     void fit(const DoubleVector& x, const DoubleVector& y);
 
+    /**
+     * @brief importData prints peak positions, their Monte Carlo and Fisher
+     * information uncertainties
+     */
     void importData(QTextStream& out) const;
 private:
     std::vector<std::shared_ptr<InterpolatorFun>> mShapes;
 
-    void minimize(const Function& fun);
+    //Copies shapes, used for independent refits
+    MultiShapeFit(const MultiShapeFit& other);
+
+    //Fits peak positions and common width to y starting from the current ones
+    void minimize(const DoubleVector& x, const DoubleVector& y);
 
     void setWidth(double w);
 
     bool calcAmps(const DoubleVector& x, const DoubleVector& y);
 
+    void estimateFisherErrors(const DoubleVector& x);
+
     double mW;
     DoubleVector mUncertainties;
+    DoubleVector mFisherErrors;
+    MonteCarlo mMonteCarlo;
 };
 
 #endif // CURVEFITTING_H
@@ -0,0 +1,47 @@
+#include "FisherInformation.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <limits>
+
+std::vector<double> math::fisherErrors
+(
+    const std::vector<double>& mu,
+    const std::vector<std::vector<double>>& jac
+)
+{
+    const size_t nPars = jac.size();
+    Eigen::MatrixXd F = Eigen::MatrixXd::Zero(nPars, nPars);
+    for(size_t i = 0; i < mu.size(); ++i)
+    {
+        //Bins with no expected counts carry no information
+        if(!(mu[i] > 0.0)) continue;
+        const double w = 1.0 / mu[i];
+        for(size_t k = 0; k < nPars; ++k)
+        {
+            const double wjk = w * jac[k][i];
+            for(size_t l = 0; l <= k; ++l) F(k, l) += wjk * jac[l][i];
+        }
+    }
+    F.triangularView<Eigen::StrictlyUpper>() = F.transpose();
+    //Parameters without information are excluded from the inversion
+    std::vector<bool> free(nPars);
+    for(size_t k = 0; k < nPars; ++k)
+    {
+        free[k] = F(k, k) > 0.0;
+        if(!free[k])
+        {
+            F.row(k).setZero();
+            F.col(k).setZero();
+            F(k, k) = 1.0;
+        }
+    }
+    const Eigen::MatrixXd C = F.ldlt().solve(Eigen::MatrixXd::Identity(nPars, nPars));
+    std::vector<double> res(nPars);
+    for(size_t k = 0; k < nPars; ++k)
+    {
+        res[k] = free[k] && C(k, k) > 0.0
+                ? std::sqrt(C(k, k))
+                : std::numeric_limits<double>::infinity();
+    }
+    return res;
+}
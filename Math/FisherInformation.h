@@ -0,0 +1,24 @@
+#ifndef FISHERINFORMATION_H
+#define FISHERINFORMATION_H
+
+#include <vector>
+
+namespace math
+{
+    /**
+     * @brief fisherErrors estimates standard errors of fitted parameters of
+     * Poisson counts from the inverse of Fisher information J^T W J, where
+     * J is the Jacobian of expected counts at the optimum and W = 1 / mu.
+     * Parameters the counts do not depend on get infinite errors
+     * @param mu expected counts at the optimum
+     * @param jac derivatives of expected counts, jac[k][i] = d mu[i] / d p[k]
+     * @return standard errors of parameters p[k]
+     */
+    std::vector<double> fisherErrors
+    (
+        const std::vector<double>& mu,
+        const std::vector<std::vector<double>>& jac
+    );
+}
+
+#endif // FISHERINFORMATION_H
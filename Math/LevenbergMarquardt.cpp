@@ -0,0 +1,85 @@
+#include "LevenbergMarquardt.h"
+#include <Eigen/Dense>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+    double sumSquares(const LevenbergMarquardt::DoubleVector& r)
+    {
+        double s = 0.0;
+        for(double rr : r) s += rr * rr;
+        return s;
+    }
+}
+
+LevenbergMarquardt::LevenbergMarquardt(size_t maxIter, double relTol)
+    :
+      mMaxIter(maxIter),
+      mRelTol(relTol),
+      mIterations(0)
+{
+}
+
+double LevenbergMarquardt::minimize(const Residuals &fun, DoubleVector &p)
+{
+    using RowMatrix = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+    const Eigen::Index n = static_cast<Eigen::Index>(p.size());
+    DoubleVector r, jac, rTrial, trial(p.size());
+    if(!fun(p, r, &jac))
+        throw std::runtime_error("Initial parameters are out of function domain!");
+    double cost = sumSquares(r);
+    double lambda = -1.0;
+    mIterations = 0;
+    while(mIterations < mMaxIter && std::isfinite(cost))
+    {
+        const Eigen::Map<const RowMatrix> J(jac.data(), static_cast<Eigen::Index>(r.size()), n);
+        const Eigen::Map<const Eigen::VectorXd> R(r.data(), static_cast<Eigen::Index>(r.size()));
+        const Eigen::MatrixXd A = J.transpose() * J;
+        const Eigen::VectorXd g = J.transpose() * R;
+        //Parameters without influence are damped by the largest scale
+        Eigen::VectorXd D = A.diagonal();
+        const double dMax = D.maxCoeff();
+        if(!(dMax > 0.0)) break;
+        for(Eigen::Index k = 0; k < n; ++k) if(!(D(k) > 0.0)) D(k) = dMax;
+        if(lambda < 0.0) lambda = 1e-3;
+        double trialCost = cost;
+        Eigen::VectorXd delta;
+        bool accepted = false;
+        while(!accepted && lambda < 1e16)
+        {
+            Eigen::MatrixXd M = A;
+            M.diagonal() += lambda * D;
+            delta = M.ldlt().solve(-g);
+            for(Eigen::Index k = 0; k < n; ++k) trial[k] = p[k] + delta(k);
+            accepted = delta.allFinite()
+                    && fun(trial, rTrial, nullptr)
+                    && (trialCost = sumSquares(rTrial)) <= cost;
+            lambda = accepted ? std::max(lambda / 3.0, 1e-12) : lambda * 4.0;
+        }
+        if(!accepted) break;
+        ++mIterations;
+        const double decrease = cost - trialCost;
+        double pNorm = 0.0;
+        for(double pp : p) pNorm += pp * pp;
+        p.swap(trial);
+        if
+        (
+            decrease <= mRelTol * cost
+            || delta.norm() <= mRelTol * (std::sqrt(pNorm) + mRelTol)
+        )
+        {
+            fun(p, r, nullptr);
+            cost = sumSquares(r);
+            break;
+        }
+        fun(p, r, &jac);
+        cost = sumSquares(r);
+    }
+    return cost;
+}
+
+size_t LevenbergMarquardt::iterations() const
+{
+    return mIterations;
+}
@@ -0,0 +1,51 @@
+#ifndef LEVENBERGMARQUARDT_H
+#define LEVENBERGMARQUARDT_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/**
+ * @brief The LevenbergMarquardt class minimizes sum of squared residuals
+ * using their Jacobian. Damping is scaled by the diagonal of J^T J, it is
+ * decreased after successful steps and increased after rejected ones
+ */
+class LevenbergMarquardt
+{
+public:
+    using DoubleVector = std::vector<double>;
+
+    /**
+     * @brief Residuals calculates residuals r at parameters p and, if jac
+     * is not null, their Jacobian in row major order:
+     * (*jac)[i * p.size() + k] = d r[i] / d p[k].
+     * Returns false if p is out of function domain
+     */
+    using Residuals = std::function<bool(const DoubleVector& p, DoubleVector& r, DoubleVector* jac)>;
+
+    static const size_t s_defaultMaxIter = 200;
+
+    explicit LevenbergMarquardt
+    (
+        size_t maxIter = s_defaultMaxIter,
+        double relTol = 1e-9
+    );
+
+    /**
+     * @brief minimize starts from p and leaves the best parameters there
+     * @return sum of squared residuals
+     */
+    double minimize(const Residuals& fun, DoubleVector& p);
+
+    /**
+     * @brief iterations number of accepted steps of the last minimization
+     */
+    size_t iterations() const;
+
+private:
+    size_t mMaxIter;
+    double mRelTol;
+    size_t mIterations;
+};
+
+#endif // LEVENBERGMARQUARDT_H
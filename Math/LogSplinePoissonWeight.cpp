@@ -1,8 +1,7 @@
 #include "LogSplinePoissonWeight.h"
 #include "ParSplineCalc.h"
 #include "Solvers.h"
-
-#include <random>
+#include "MonteCarlo.h"
 
 LogSplinePoissonWeight::LogSplinePoissonWeight
 (
@@ -70,43 +69,9 @@ void LogSplinePoissonWeightPoissonNoise::run
         (
             ParSplineCalc::lockInstance()
         );
-        calc->logSplinePoissonWeights(yOut, yIn, *m_p);
-        double TIC = std::accumulate(yOut.begin(), yOut.end(), 0.0);
-        double s = sqDif(yOut, yIn);
-
-        double a, b;
-        if(s > TIC)
-        {
-            while (s > TIC)
-            {
-                calc->logSplinePoissonWeights
-                (
-                    yOut,
-                    yIn,
-                    *m_p /= 10.
-                );
-                s = sqDif(yOut, yIn);
-                TIC = std::accumulate(yOut.begin(), yOut.end(), 0.0);
-            }
-            a = *m_p; b = *m_p * 10.;
-        }
-        else
-        {
-            while(s < TIC)
-            {
-                calc->logSplinePoissonWeights
-                (
-                    yOut,
-                    yIn,
-                    *m_p *= 10.
-                );
-                s = sqDif(yOut, yIn);
-                TIC = std::accumulate(yOut.begin(), yOut.end(), 0.0);
-            }
-            a = *m_p / 10.; b = *m_p;
-        }
-
-        math::froot
+        //Search starts from the parameter found last time
+        double last = 0.0;
+        *m_p = math::frootlog
         (
             [&](double x)->double
             {
@@ -114,12 +79,13 @@ void LogSplinePoissonWeightPoissonNoise::run
                 (
                     yOut,
                     yIn,
-                    x
+                    last = x
                 );
-                return sqDif(yOut, yIn) - std::accumulate(yOut.begin(), yOut.end(), 0.0);
+                return sqDif(yOut, yIn) - sum(yOut);
             },
-            a, b
+            *m_p
         );
+        if(last != *m_p) calc->logSplinePoissonWeights(yOut, yIn, *m_p);
     }
 }
 
@@ -251,39 +217,9 @@ void LSFixNoiseValue::run
         (
             ParSplineCalc::lockInstance()
         );
-        calc->logSplinePoissonWeights(yOut, yIn, *m_p);
-        double s = std(yOut, yIn);
-        double a, b;
-        if(s > *m_noise)
-        {
-            while (s > *m_noise)
-            {
-                calc->logSplinePoissonWeights
-                (
-                    yOut,
-                    yIn,
-                    *m_p /= 10.
-                );
-                s = std(yOut, yIn);
-            }
-            a = *m_p; b = *m_p * 10.;
-        }
-        else
-        {
-            while(s < *m_noise)
-            {
-                calc->logSplinePoissonWeights
-                (
-                    yOut,
-                    yIn,
-                    *m_p *= 10.
-                );
-                s = std(yOut, yIn);
-            }
-            a = *m_p / 10.; b = *m_p;
-        }
-
-        *m_p = math::froot
+        //Search starts from the parameter found last time
+        double last = 0.0;
+        *m_p = math::frootlog
         (
             [&](double x)->double
             {
@@ -291,41 +227,37 @@ void LSFixNoiseValue::run
                 (
                     yOut,
                     yIn,
-                    x
+                    last = x
                 );
                 return std(yOut, yIn) - *m_noise;
             },
-            a,
-            b
+            *m_p
         );
+        if(last != *m_p) calc->logSplinePoissonWeights(yOut, yIn, *m_p);
 
         m_maxPeakPos = maxPeakPos(yOut);
 
-        m_maxPeakPosUncertainty = 0.0;
-
-        const size_t nRuns = 10;
-        VectorDouble yy(yOut.size()), yyOut(yOut.size());
-        std::poisson_distribution<> dist;
-        std::mt19937_64 gen;
-        for(size_t i = 0; i < nRuns; ++i)
-        {
-            for(size_t j = 0; j < yOut.size(); ++j)
+        //Replicates of a batch are smoothed by one call
+        MonteCarlo monteCarlo;
+        monteCarlo.setProperties(params());
+        m_maxPeakPosUncertainty = monteCarlo.runBatch
+        (
+            [&]()->VectorDouble
             {
-                if(yOut[j] > 0.0)
-                {
-                    dist.param(std::poisson_distribution<>::param_type(yOut[j]));
-                    yy[j] = dist(gen);
-                }
-                else
+                return yOut;
+            },
+            [&](const MonteCarlo::Replicates& yy)->MonteCarlo::Replicates
+            {
+                MonteCarlo::Replicates yyOut;
+                calc->logSplinePoissonWeights(yyOut, yy, *m_p);
+                MonteCarlo::Replicates d(yyOut.size());
+                for(size_t i = 0; i < yyOut.size(); ++i)
                 {
-                    yy[j] = 0.0;
+                    d[i] = VectorDouble{maxPeakPos(yyOut[i]) - m_maxPeakPos};
                 }
+                return d;
             }
-            calc->logSplinePoissonWeights(yyOut, yy, *m_p);
-            double d = maxPeakPos(yyOut) - m_maxPeakPos;
-            m_maxPeakPosUncertainty += d*d;
-        }
-        m_maxPeakPosUncertainty = std::sqrt(m_maxPeakPosUncertainty/nRuns);
+        )[0];
     }
 }
 
@@ -334,6 +266,9 @@ QVariantMap LSFixNoiseValue::paramsTemplate() const
     QVariantMap params;
     params[SMOOTH_PARAM] = QVariant::fromValue<double>(1.0);
     params[NOISE_LEVEL] = QVariant::fromValue<double>(0.1);
+    params.unite(MonteCarlo(10, 100).properties());
+    //Smoothing parameter uncertainty has no analytic estimate
+    params.remove(FAST_ERRORS);
     return params;
 }
 
@@ -354,3 +289,69 @@ double LSFixNoiseValue::peakPositionUncertainty() const
     return m_maxPeakPosUncertainty;
 }
 
+LogSplineGcv::LogSplineGcv(const QVariantMap &pars)
+    :
+      Smoother(pars, paramsTemplate()),
+      m_p(paramPtr<double>(SMOOTH_PARAM))
+{
+
+}
+
+Smoother::Type LogSplineGcv::type() const
+{
+    return LogSplineGcvType;
+}
+
+void LogSplineGcv::run
+(
+    VectorDouble &yOut,
+    const VectorDouble &yIn
+)
+{
+    if(inputCheck(yOut, yIn))
+    {
+        ParSplineCalc::InstanceLocker calc
+        (
+            ParSplineCalc::lockInstance()
+        );
+        //Score is minimized over log of the parameter
+        double last = 0.0;
+        auto score = [&](double u)->double
+        {
+            return calc->logSplineGcv(yOut, yIn, last = std::exp(u));
+        };
+
+        //Minimum is bracketed by decade steps from the previous parameter
+        const int maxSteps = 12;
+        const double h = std::log(10.);
+        double u = std::log(*m_p > 0.0 ? *m_p : 1.0);
+        double f = score(u);
+        double step = h;
+        double fNext = score(u + step);
+        if(fNext >= f)
+        {
+            step = -h;
+            fNext = score(u + step);
+        }
+        for(int i = 0; i < maxSteps && fNext < f; ++i)
+        {
+            u += step;
+            f = fNext;
+            fNext = score(u + step);
+        }
+
+        *m_p = std::exp(math::goldenmin(score, u - h, u + h, 0.05));
+        if(last != *m_p) calc->logSplineGcv(yOut, yIn, *m_p);
+    }
+}
+
+QVariantMap LogSplineGcv::paramsTemplate() const
+{
+    return LogSplinePoissonWeight(QVariantMap()).paramsTemplate();
+}
+
+void LogSplineGcv::setParams(const QVariantMap &params)
+{
+    Smoother::setParams(params);
+    m_p = paramPtr<double>(SMOOTH_PARAM);
+}
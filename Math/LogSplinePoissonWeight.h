@@ -98,4 +98,24 @@ public:
     double peakPositionUncertainty() const;
 };
 
+/**
+ * @brief The LogSplineGcv class chooses smoothness of log spline by
+ * minimization of generalized cross-validation score. Smoothing parameter
+ * keeps the found value and the next search starts from it
+ */
+class LogSplineGcv : public Smoother
+{
+    double * m_p;
+public:
+    LogSplineGcv(const QVariantMap& pars);
+
+    Type type() const;
+
+    void run(VectorDouble& yOut, const VectorDouble& yIn);
+
+    QVariantMap paramsTemplate() const;
+
+    void setParams(const QVariantMap& params);
+};
+
 #endif // LOGSPLINEPOISSONWEIGHT_H
@@ -1,7 +1,31 @@
 #include "Data/MassSpec.h"
 #include "MassSpecSummator.h"
 #include "Base/ThreadPool.h"
+#include "Base/Job.h"
+#include "SumKernels.h"
 #include <QtConcurrent>
+#include <cmath>
+
+namespace
+{
+template<class Map>
+Map& addMaps(Map& lhMs, const Map& rhMs)
+{
+    using Pairs = std::vector<std::pair<typename Map::key_type, typename Map::mapped_type>>;
+    Pairs merged;
+    merged.reserve(lhMs.size() + rhMs.size());
+    math::mergeSparse
+    (
+        lhMs.begin(), lhMs.end(),
+        rhMs.begin(), rhMs.end(),
+        std::back_inserter(merged)
+    );
+    //Sorted input is inserted in linear time
+    Map res(merged.begin(), merged.end());
+    lhMs.swap(res);
+    return lhMs;
+}
+}
 
 MassSpecSummator::MassSpecSummator()
 {
@@ -15,24 +39,44 @@ MassSpecSummator::~MassSpecSummator()
 
 MapUintUint &MassSpecSummator::add(MapUintUint &lhMs, const MapUintUint &rhMs) const
 {
-    for(MapUintUint::const_reference d : rhMs)
-    {
-        MapUintUint::iterator it = lhMs.find(d.first);
-        if(it != lhMs.end()) it->second += d.second;
-        else lhMs.insert(d);
-    }
-    return lhMs;
+    return addMaps(lhMs, rhMs);
 }
 
 MapIntInt &MassSpecSummator::add(MapIntInt &lhMs, const MapIntInt &rhMs) const
 {
-    for(MapIntInt::const_reference d : rhMs)
+    return addMaps(lhMs, rhMs);
+}
+
+MapUintUint MassSpecSummator::sum
+(
+    const std::vector<MapUintUint> &data,
+    size_t First,
+    size_t Last
+) const
+{
+    using Pairs = std::vector<std::pair<Uint, Uint>>;
+    if(First >= Last) return MapUintUint();
+    //Pairwise merge-join, each level is a linear pass through all data
+    std::vector<Pairs> parts(Last - First);
+    for(size_t i = 0; i < parts.size(); ++i)
+        parts[i].assign(data[First + i].begin(), data[First + i].end());
+    for(size_t stride = 1; stride < parts.size(); stride *= 2)
     {
-        MapIntInt::iterator it = lhMs.find(d.first);
-        if(it != lhMs.end()) it->second += d.second;
-        else lhMs.insert(d);
+        for(size_t i = 0; i + stride < parts.size(); i += 2 * stride)
+        {
+            Pairs merged;
+            merged.reserve(parts[i].size() + parts[i + stride].size());
+            math::mergeSparse
+            (
+                parts[i].begin(), parts[i].end(),
+                parts[i + stride].begin(), parts[i + stride].end(),
+                std::back_inserter(merged)
+            );
+            parts[i].swap(merged);
+            Pairs().swap(parts[i + stride]);
+        }
     }
-    return lhMs;
+    return MapUintUint(parts[0].begin(), parts[0].end());
 }
 
 MSSum::MSSum()
@@ -50,39 +94,251 @@ MapIntInt DirectSum::accum
     size_t _Last
 )
 {
-    QMutexLocker lock(&coll->mMut);
-    const int n = coll->nMaxBin - coll->nMinBin + 1;
-    std::vector<int> acc(static_cast<size_t>(n));
-    for(; _First != _Last && _First < _Last; ++_First)
+    MassSpectrumsCollection::StorePtr store = coll->store();
+    _Last = std::min(_Last, store->size());
+    if(_First >= _Last) return MapIntInt();
+    const int minBin = store->minBin();
+    std::vector<int64_t> acc = accumDense(*store, _First, _Last, minBin, store->maxBin());
+    MapIntInt res;
+    compressGaps(acc, minBin, [&](int bin, int64_t val)
+    {
+        res.emplace_hint(res.end(), bin, static_cast<int>(val));
+    });
+    return res;
+}
+
+std::vector<int64_t> DirectSum::accumDense
+(
+    const MassSpecStore &store,
+    size_t _First,
+    size_t _Last,
+    int minBin,
+    int maxBin
+)
+{
+    if(_First >= _Last || minBin > maxBin) return std::vector<int64_t>();
+    const size_t nBins = static_cast<size_t>(maxBin - minBin) + 1;
+
+    //Totals are used only if fewer spectra are left to correct them
+    //than to sum directly
+    const size_t nHead = _First - store.checkpointCount(_First);
+    const size_t nSize = store.size();
+    const size_t nTail = nSize > _Last ? nSize - _Last : _Last - nSize;
+    if(nHead + nTail >= _Last - _First)
+        return sumSpectra(store, _First, _Last, minBin, maxBin);
+
+    //Running total minus checkpoint is the sum of [c, n), spectra may be
+    //published meanwhile, so the counts are taken from the totals used
+    std::vector<int64_t> res(nBins, 0);
+    const size_t n = store.addTotal(res.data(), minBin, maxBin);
+    const size_t c = store.subCheckpoint(res.data(), minBin, maxBin, _First);
+
+    auto combine = [&](size_t first, size_t last, int64_t sign)
     {
-        MassSpecImpl::MapShrdPtr msDataPtr = coll->mCollection[_First]->data();
-        for(MassSpecImpl::Map::const_reference d : *msDataPtr)
+        if(first >= last) return;
+        std::vector<int64_t> part = sumSpectra(store, first, last, minBin, maxBin);
+        for(size_t i = 0; i < nBins; ++i) res[i] += sign * part[i];
+    };
+    combine(c, _First, -1);
+    if(n > _Last) combine(_Last, n, -1);
+    else combine(n, _Last, 1);
+    return res;
+}
+
+std::vector<int64_t> DirectSum::sumSpectra
+(
+    const MassSpecStore &store,
+    size_t _First,
+    size_t _Last,
+    int minBin,
+    int maxBin
+)
+{
+    const size_t nBins = static_cast<size_t>(maxBin - minBin) + 1;
+    const size_t nSpecs = _Last - _First;
+    const size_t nThreads = ThreadPool::threadsNum();
+    const size_t nBlocks = std::max<size_t>(1, std::min(nThreads, nSpecs / s_minBlockSize));
+
+    //Workers have no current job, the caller's one is checked by them
+    const Job * job = Job::current();
+    std::vector<std::vector<int64_t>> bufs(nBlocks);
+    ThreadPool::parFor(nBlocks, [&](size_t b)
+    {
+        bufs[b].assign(nBins, 0);
+        const size_t i0 = _First + nSpecs * b / nBlocks;
+        const size_t i1 = _First + nSpecs * (b + 1) / nBlocks;
+        for(size_t i = i0; i < i1; ++i)
         {
-            acc[d.first - coll->nMinBin] += d.second;
+            if(job && (i - i0) % s_minBlockSize == 0) job->checkpoint();
+            store.at(i)->addTo(bufs[b].data(), minBin, maxBin);
         }
-    }
-    MapIntInt res;
-    MapIntInt::const_iterator it = res.end();
-    for(size_t i = 0; i < acc.size(); ++i)
+    });
+
+    //Tree reduction: on each level buffer i takes buffer i + stride
+    for(size_t stride = 1; stride < nBlocks; stride *= 2)
     {
-        if(acc[i] != 0.0)
+        ThreadPool::parFor((nBlocks + 2 * stride - 1) / (2 * stride), [&](size_t k)
         {
-            it = res.insert(it, {i + coll->nMinBin, acc[i]});
-            ++it;
-        }
+            const size_t i = 2 * stride * k, j = i + stride;
+            if(j >= nBlocks) return;
+            int64_t * dst = bufs[i].data();
+            const int64_t * src = bufs[j].data();
+            for(size_t n = 0; n < nBins; ++n) dst[n] += src[n];
+            std::vector<int64_t>().swap(bufs[j]);
+        });
     }
-    it = res.insert(res.begin(), {res.begin()->first - 1, 0});
-    while(++it != res.end())
+    return std::move(bufs[0]);
+}
+
+DriftCorrectedSum::DriftCorrectedSum
+(
+    size_t step,
+    int peakWidth,
+    int refMinBin,
+    int refMaxBin
+)
+    :
+      mStep(step),
+      mPeakWidth(std::max(peakWidth, 1)),
+      mRefMinBin(std::min(refMinBin, refMaxBin)),
+      mRefMaxBin(std::max(refMinBin, refMaxBin))
+{
+}
+
+MapIntInt DriftCorrectedSum::accum
+(
+    MassSpectrumsCollection *coll,
+    size_t _First,
+    size_t _Last
+)
+{
+    MassSpectrumsCollection::StorePtr store = coll->store();
+    const int minBin = store->minBin();
+    std::vector<double> acc = accumDense
+    (
+        *store,
+        _First,
+        std::min(_Last, store->size()),
+        minBin,
+        store->maxBin()
+    );
+    MapIntInt res;
+    compressGaps(acc, minBin, [&](int bin, double val)
     {
-        if(std::prev(it)->first + 1 != it->first)
+        res.emplace_hint(res.end(), bin, static_cast<int>(std::round(val)));
+    });
+    return res;
+}
+
+std::vector<double> DriftCorrectedSum::accumDense
+(
+    const MassSpecStore &store,
+    size_t _First,
+    size_t _Last,
+    int minBin,
+    int maxBin
+)
+{
+    mShifts.clear();
+    if(_First >= _Last || minBin > maxBin) return std::vector<double>();
+    const size_t nBins = static_cast<size_t>(maxBin - minBin) + 1;
+    const size_t step = mStep == 0 ? _Last - _First : mStep;
+    const size_t nBlocks = (_Last - _First + step - 1) / step;
+    //Blocks are summed by waves of one block per thread, so only a wave of
+    //dense buffers is kept in memory
+    const size_t nWave = std::max<size_t>(1, ThreadPool::threadsNum());
+    std::vector<double> res(nBins, 0.0);
+    std::vector<std::vector<int64_t>> blocks(std::min(nWave, nBlocks));
+    std::vector<double> centroids(blocks.size());
+    const Job * job = Job::current();
+    double ref = std::numeric_limits<double>::quiet_NaN();
+    for(size_t b0 = 0; b0 < nBlocks; b0 += nWave)
+    {
+        Job::check();
+        Job::report(static_cast<qint64>(b0), static_cast<qint64>(nBlocks));
+        const size_t m = std::min(nWave, nBlocks - b0);
+        auto blockSum = [&](size_t b)
         {
-            res.insert(it, {it->first - 1, 0});
-        }
-        if(std::next(it) == res.end() || std::next(it)->first - 1 != it->first)
+            const size_t first = _First + (b0 + b) * step;
+            const size_t last = std::min(first + step, _Last);
+            if(m == 1)
+            {
+                //Single block is summed in parallel by itself
+                blocks[b] = DirectSum::accumDense(store, first, last, minBin, maxBin);
+            }
+            else
+            {
+                blocks[b].assign(nBins, 0);
+                for(size_t i = first; i < last; ++i)
+                {
+                    if(job && (i - first) % DirectSum::s_minBlockSize == 0) job->checkpoint();
+                    store.at(i)->addTo(blocks[b].data(), minBin, maxBin);
+                }
+            }
+            centroids[b] = peakCentroid(blocks[b], minBin);
+        };
+        if(m == 1) blockSum(0);
+        else ThreadPool::parFor(m, blockSum, 1);
+
+        //Shifts follow the order of blocks, reference is the first found peak
+        std::vector<int64_t> ks(m);
+        std::vector<double> fs(m);
+        for(size_t b = 0; b < m; ++b)
         {
-            res.insert(std::next(it), {it->first + 1, 0});
-            ++it;
+            const double c = centroids[b];
+            if(std::isnan(ref)) ref = c;
+            const double shift = std::isnan(c) || std::isnan(ref) ? 0.0 : ref - c;
+            mShifts.push_back(shift);
+            ks[b] = static_cast<int64_t>(std::floor(shift));
+            fs[b] = shift - static_cast<double>(ks[b]);
         }
+
+        //Value at bin i moves to i + shift and is split between two bins,
+        //threads own ranges of destination bins
+        const int64_t n = static_cast<int64_t>(nBins);
+        ThreadPool::parFor(nBins, [&](size_t jj)
+        {
+            const int64_t j = static_cast<int64_t>(jj);
+            double v = 0.0;
+            for(size_t b = 0; b < m; ++b)
+            {
+                const int64_t i = j - ks[b], ip = i - 1;
+                const double f = fs[b];
+                if(i >= 0 && i < n) v += (1.0 - f) * static_cast<double>(blocks[b][static_cast<size_t>(i)]);
+                if(ip >= 0 && ip < n) v += f * static_cast<double>(blocks[b][static_cast<size_t>(ip)]);
+            }
+            res[jj] += v;
+        });
     }
     return res;
 }
+
+const std::vector<double> &DriftCorrectedSum::shifts() const
+{
+    return mShifts;
+}
+
+double DriftCorrectedSum::peakCentroid(const std::vector<int64_t> &acc, int minBin) const
+{
+    const int n = static_cast<int>(acc.size());
+    const int lo = std::max(mRefMinBin - minBin, 0);
+    const int hi = std::min(mRefMaxBin - minBin, n - 1);
+    if(lo > hi) return std::numeric_limits<double>::quiet_NaN();
+    const int apex = static_cast<int>
+    (
+        std::max_element(acc.begin() + lo, acc.begin() + hi + 1) - acc.begin()
+    );
+    double s = 0.0, sx = 0.0;
+    for
+    (
+        int i = std::max(apex - mPeakWidth / 2, 0);
+        i <= std::min(apex + mPeakWidth / 2, n - 1);
+        ++i
+    )
+    {
+        s += static_cast<double>(acc[static_cast<size_t>(i)]);
+        sx += static_cast<double>(acc[static_cast<size_t>(i)]) * i;
+    }
+    if(s == 0.0) return std::numeric_limits<double>::quiet_NaN();
+    return sx / s + minBin;
+}
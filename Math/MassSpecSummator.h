@@ -2,6 +2,7 @@
 #define MASSSPECSUMMATOR_H
 
 #include <map>
+#include <vector>
 #include <Data/MassSpecImpl.h>
 
 using Uint = unsigned long long;
@@ -18,6 +19,12 @@ public:
     virtual MapUintUint& add(MapUintUint& lhMs, const MapUintUint& rhMs) const;
 
     virtual MapIntInt& add(MapIntInt& lhMs, const MapIntInt& rhMs) const;
+
+    /**
+     * @brief sum sums mass spectra data[First, Last) by pairwise merging
+     * @return
+     */
+    MapUintUint sum(const std::vector<MapUintUint>& data, size_t First, size_t Last) const;
 };
 
 class MSSum
@@ -38,15 +45,132 @@ public:
     ) = 0;
 };
 
+class MassSpecStore;
+
 class DirectSum : public MSSum
 {
 public:
+    //Min number of mass spectra summed by one thread
+    static const size_t s_minBlockSize = 64;
+
+    MapIntInt accum
+    (
+        MassSpectrumsCollection * coll,
+        size_t _First,
+        size_t _Last
+    );
+
+    /**
+     * @brief accumDense sums mass spectra. Ranges up to the last mass spectrum
+     * are taken from the running total of the store and its checkpoints,
+     * other ones are summed by sumSpectra
+     * @return acc[i] is intensity of the bin minBin + i
+     */
+    static std::vector<int64_t> accumDense
+    (
+        const MassSpecStore& store,
+        size_t _First,
+        size_t _Last,
+        int minBin,
+        int maxBin
+    );
+
+    /**
+     * @brief sumSpectra sums mass spectra in parallel. Each thread adds its
+     * block of spectra into own buffer, buffers are merged pairwise
+     * @return acc[i] is intensity of the bin minBin + i
+     */
+    static std::vector<int64_t> sumSpectra
+    (
+        const MassSpecStore& store,
+        size_t _First,
+        size_t _Last,
+        int minBin,
+        int maxBin
+    );
+
+    /**
+     * @brief compressGaps passes nonzero bins of dense accumulator and their
+     * zero neighbours to op in one linear pass, empty runs between them are
+     * dropped. Bins next to the accumulator edges are also passed
+     * @param acc acc[i] is intensity of the bin minBin + i
+     * @param op called as op(int bin, T intensity) in increasing bin order
+     */
+    template<typename T, typename Op>
+    static void compressGaps(const std::vector<T>& acc, int minBin, Op op)
+    {
+        const int64_t n = static_cast<int64_t>(acc.size());
+        //Intensities at i - 1, i and i + 1, bins outside of acc are zero
+        T prev = 0, cur = 0, next = 0;
+        for(int64_t i = -1; i <= n; ++i)
+        {
+            prev = cur;
+            cur = next;
+            next = i + 1 < n ? acc[static_cast<size_t>(i + 1)] : 0;
+            if(prev != 0 || cur != 0 || next != 0)
+                op(minBin + static_cast<int>(i), cur);
+        }
+    }
+};
+
+/**
+ * @brief The DriftCorrectedSum class sums mass spectra by blocks of step
+ * spectra. Reference peak is located in each block and the block is shifted,
+ * with linear interpolation for fractional shifts, to put the peak where it
+ * is in the first block
+ */
+class DriftCorrectedSum : public MSSum
+{
+public:
+    /**
+     * @param step number of mass spectra in block, 0 means one block
+     * @param peakWidth width of the reference peak in bins
+     * @param refMinBin reference peak is searched in [refMinBin, refMaxBin]
+     * @param refMaxBin
+     */
+    DriftCorrectedSum(size_t step, int peakWidth, int refMinBin, int refMaxBin);
+
     MapIntInt accum
     (
         MassSpectrumsCollection * coll,
         size_t _First,
         size_t _Last
     );
+
+    /**
+     * @brief accumDense sums blocks of mass spectra after drift correction.
+     * Blocks are summed in parallel, one per thread, then shifted and
+     * reduced in parallel over bins
+     * @return acc[i] is intensity of the bin minBin + i
+     */
+    std::vector<double> accumDense
+    (
+        const MassSpecStore& store,
+        size_t _First,
+        size_t _Last,
+        int minBin,
+        int maxBin
+    );
+
+    /**
+     * @brief shifts returns shifts in bins applied to the blocks of last accumulation
+     * @return
+     */
+    const std::vector<double>& shifts() const;
+
+    /**
+     * @brief peakCentroid finds apex of the peak in [refMinBin, refMaxBin]
+     * and returns centroid of peakWidth bins around it
+     * @return NaN if there are no events in the range
+     */
+    double peakCentroid(const std::vector<int64_t>& acc, int minBin) const;
+
+private:
+    const size_t mStep;
+    const int mPeakWidth;
+    const int mRefMinBin;
+    const int mRefMaxBin;
+    std::vector<double> mShifts;
 };
 
 #endif // MASSSPECSUMMATOR_H
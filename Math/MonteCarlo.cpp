@@ -0,0 +1,190 @@
+#include "MonteCarlo.h"
+#include "Base/ThreadPool.h"
+#include "Base/Job.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <random>
+
+MonteCarlo::MonteCarlo
+(
+    size_t minRuns,
+    size_t maxRuns,
+    double relPrecision,
+    uint64_t seed
+)
+    :
+      mMinRuns(std::max<size_t>(minRuns, 2)),
+      mMaxRuns(std::max(maxRuns, mMinRuns)),
+      mRelPrecision(relPrecision),
+      mSeed(seed),
+      mRunsDone(0),
+      mFastErrors(false)
+{
+}
+
+MonteCarlo::DoubleVector MonteCarlo::run(const Model &model, const Refit &refit)
+{
+    const DoubleVector y = model();
+    Replicates dev;
+    //Pool workers do not see the job of the calling thread
+    Job * const job = Job::current();
+    std::atomic<size_t> done(0);
+    for(size_t n = 0, nBatch; (nBatch = nextBatch(n)) != 0; n += nBatch)
+    {
+        dev.resize(n + nBatch);
+        ThreadPool::parFor
+        (
+            nBatch,
+            [&](size_t i)->void
+            {
+                if(job) job->checkpoint();
+                DoubleVector ty;
+                sample(y, n + i, ty);
+                dev[n + i] = refit(ty);
+                //Runs end at convergence, so progress goes to the next check
+                if(job)
+                    job->setProgress(static_cast<qint64>(++done), static_cast<qint64>(n + nBatch));
+            }
+        );
+        if(converged(dev)) break;
+    }
+    mRunsDone = dev.size();
+    return rms(dev);
+}
+
+MonteCarlo::DoubleVector MonteCarlo::runBatch(const Model &model, const BatchRefit &refit)
+{
+    const DoubleVector y = model();
+    Replicates dev;
+    for(size_t n = 0, nBatch; (nBatch = nextBatch(n)) != 0; n += nBatch)
+    {
+        Replicates ty(nBatch);
+        ThreadPool::parFor
+        (
+            nBatch,
+            [&](size_t i)->void
+            {
+                sample(y, n + i, ty[i]);
+            }
+        );
+        Job::check();
+        Job::report(static_cast<qint64>(n), static_cast<qint64>(n + nBatch));
+        Replicates d = refit(ty);
+        d.resize(nBatch);
+        for(DoubleVector& dd : d) dev.push_back(std::move(dd));
+        if(converged(dev)) break;
+    }
+    mRunsDone = dev.size();
+    return rms(dev);
+}
+
+void MonteCarlo::sample(const DoubleVector &y, size_t idx, DoubleVector &out) const
+{
+    //Stream of a replicate depends only on the seed and its index
+    std::seed_seq seq
+    {
+        static_cast<uint32_t>(mSeed),
+        static_cast<uint32_t>(mSeed >> 32),
+        static_cast<uint32_t>(idx),
+        static_cast<uint32_t>(static_cast<uint64_t>(idx) >> 32)
+    };
+    std::mt19937_64 gen(seq);
+    std::poisson_distribution<> dist;
+    out.resize(y.size());
+    for(size_t j = 0; j < y.size(); ++j)
+    {
+        if(y[j] > 0.0)
+        {
+            dist.param(std::poisson_distribution<>::param_type(y[j]));
+            out[j] = dist(gen);
+        }
+        else
+        {
+            out[j] = 0.0;
+        }
+    }
+}
+
+QVariantMap MonteCarlo::properties() const
+{
+    return QVariantMap
+    {
+        {MC_MIN_RUNS, static_cast<int>(mMinRuns)},
+        {MC_MAX_RUNS, static_cast<int>(mMaxRuns)},
+        {MC_REL_PRECISION, mRelPrecision},
+        {FAST_ERRORS, static_cast<int>(mFastErrors)}
+    };
+}
+
+void MonteCarlo::setProperties(const QVariantMap &props)
+{
+    QVariantMap::ConstIterator it = props.find(MC_MIN_RUNS);
+    if(it != props.end()) mMinRuns = std::max(it.value().toInt(), 2);
+    if((it = props.find(MC_MAX_RUNS)) != props.end())
+        mMaxRuns = static_cast<size_t>(std::max(it.value().toInt(), 0));
+    if((it = props.find(MC_REL_PRECISION)) != props.end())
+        mRelPrecision = it.value().toDouble();
+    if((it = props.find(FAST_ERRORS)) != props.end())
+        mFastErrors = it.value().toInt() != 0;
+    mMaxRuns = std::max(mMaxRuns, mMinRuns);
+}
+
+size_t MonteCarlo::runsDone() const
+{
+    return mRunsDone;
+}
+
+bool MonteCarlo::fastErrors() const
+{
+    return mFastErrors;
+}
+
+uint64_t MonteCarlo::seed() const
+{
+    return mSeed;
+}
+
+size_t MonteCarlo::nextBatch(size_t done) const
+{
+    if(done < mMinRuns) return mMinRuns - done;
+    const size_t batch = s_batchRuns;
+    return std::min(batch, mMaxRuns - done);
+}
+
+bool MonteCarlo::converged(const Replicates &dev) const
+{
+    //Standard error of rms deviation s is estimated from the spread of
+    //squared deviations: se(s) = se(s^2) / 2s
+    const size_t n = dev.size();
+    if(n < 2) return false;
+    const size_t nPars = dev.front().size();
+    for(size_t j = 0; j < nPars; ++j)
+    {
+        double s2 = 0.0;
+        for(const DoubleVector& d : dev) s2 += d[j] * d[j];
+        s2 /= n;
+        if(s2 == 0.0) continue;
+        double v = 0.0;
+        for(const DoubleVector& d : dev)
+        {
+            const double dd = d[j] * d[j] - s2;
+            v += dd * dd;
+        }
+        v /= n - 1;
+        if(std::sqrt(v / n) / (2.0 * s2) > mRelPrecision) return false;
+    }
+    return true;
+}
+
+MonteCarlo::DoubleVector MonteCarlo::rms(const Replicates &dev)
+{
+    DoubleVector res;
+    if(dev.empty()) return res;
+    res.assign(dev.front().size(), 0.0);
+    for(const DoubleVector& d : dev)
+        for(size_t j = 0; j < res.size() && j < d.size(); ++j)
+            res[j] += d[j] * d[j];
+    for(double& r : res) r = std::sqrt(r / dev.size());
+    return res;
+}
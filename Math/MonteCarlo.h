@@ -0,0 +1,122 @@
+#ifndef MONTECARLO_H
+#define MONTECARLO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <QVariantMap>
+
+//Monte Carlo properties
+const QString MC_MIN_RUNS = "MC min. runs";
+const QString MC_MAX_RUNS = "MC max. runs";
+const QString MC_REL_PRECISION = "MC rel. precision";
+//Nonzero value replaces replicates with Fisher information errors
+const QString FAST_ERRORS = "Fast errors";
+
+/**
+ * @brief The MonteCarlo class estimates uncertainties of fitted parameters
+ * by refits of Poisson resampled model curves. Replicates are distributed
+ * over the thread pool, every replicate draws counts from its own random
+ * stream defined by the seed and the replicate index, and deviations are
+ * summed in replicate order, so results do not depend on number of threads.
+ * After the first minRuns replicates the next ones are run by batches
+ * until relative standard error of every uncertainty falls below the
+ * precision target or maxRuns is reached. In fast errors mode fitters skip
+ * replicates and report errors from Fisher information only
+ */
+class MonteCarlo
+{
+public:
+    using DoubleVector = std::vector<double>;
+    using Replicates = std::vector<DoubleVector>;
+
+    /**
+     * @brief Model returns expected counts replicates are drawn from
+     */
+    using Model = std::function<DoubleVector()>;
+
+    /**
+     * @brief Refit fits one replicate and returns deviations of parameters
+     * of interest from their values fitted to the data. It is called
+     * concurrently for different replicates
+     */
+    using Refit = std::function<DoubleVector(const DoubleVector& y)>;
+
+    /**
+     * @brief BatchRefit fits a batch of replicates at once and returns their
+     * deviations in the same order
+     */
+    using BatchRefit = std::function<Replicates(const Replicates& y)>;
+
+    static const size_t s_defaultMinRuns = 20;
+    static const size_t s_defaultMaxRuns = 500;
+    //Replicates added at once after the first minRuns
+    static const size_t s_batchRuns = 16;
+    static const uint64_t s_defaultSeed = 0x9e3779b97f4a7c15ull;
+
+    explicit MonteCarlo
+    (
+        size_t minRuns = s_defaultMinRuns,
+        size_t maxRuns = s_defaultMaxRuns,
+        double relPrecision = 0.1,
+        uint64_t seed = s_defaultSeed
+    );
+
+    /**
+     * @brief run refits replicates of the model one by one
+     * @return root mean square deviations
+     */
+    DoubleVector run(const Model& model, const Refit& refit);
+
+    /**
+     * @brief runBatch draws replicates of the model and refits each batch
+     * of them by one call
+     * @return root mean square deviations
+     */
+    DoubleVector runBatch(const Model& model, const BatchRefit& refit);
+
+    /**
+     * @brief sample draws replicate idx of expected counts y
+     */
+    void sample(const DoubleVector& y, size_t idx, DoubleVector& out) const;
+
+    /**
+     * @brief properties returns run limits which can be shown to the user
+     * together with fitting properties
+     */
+    QVariantMap properties() const;
+
+    /**
+     * @brief setProperties takes known keys from props, other keys are skipped
+     */
+    void setProperties(const QVariantMap& props);
+
+    /**
+     * @brief runsDone number of replicates of the last run
+     */
+    size_t runsDone() const;
+
+    /**
+     * @brief fastErrors true if fitters should not run replicates
+     */
+    bool fastErrors() const;
+
+    uint64_t seed() const;
+
+private:
+    size_t mMinRuns;
+    size_t mMaxRuns;
+    double mRelPrecision;
+    uint64_t mSeed;
+    size_t mRunsDone;
+    bool mFastErrors;
+
+    size_t nextBatch(size_t done) const;
+
+    bool converged(const Replicates& dev) const;
+
+    static DoubleVector rms(const Replicates& dev);
+};
+
+#endif // MONTECARLO_H
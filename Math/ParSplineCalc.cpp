@@ -1,10 +1,13 @@
 #include "ParSplineCalc.h"
 #include "Solvers.h"
-#include "Base/BaseObject.h"
 #include "Base/ThreadPool.h"
-#include <QMutex>
+#include "Base/Job.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
-QMutex ParSplineCalc::s_mutex;
+std::mutex ParSplineCalc::s_poolMutex;
+std::vector<std::unique_ptr<ParSplineCalc>> ParSplineCalc::s_pool;
 
 ParSplineCalc::ParSplineCalc(QObject *parent)
     :
@@ -15,7 +18,8 @@ ParSplineCalc::ParSplineCalc(QObject *parent)
       d(new VectorDouble),
       e(new VectorDouble),
       bb(new VectorDouble),
-      r(new VectorDouble)
+      r(new VectorDouble),
+      w(new VectorDouble)
 {
     setObjectName("ParSplineCalc");
 }
@@ -27,19 +31,23 @@ ParSplineCalc::~ParSplineCalc()
 
 ParSplineCalc::InstanceLocker ParSplineCalc::lockInstance(bool clearMemory)
 {
-    if (s_mutex.tryLock())
-        return InstanceLocker
-		(
-            MyInit::instance()->findChild<ParSplineCalc*>("ParSplineCalc"),
-			clearMemory
-		);
-    else
-        return InstanceLocker();
+    std::unique_ptr<ParSplineCalc> instance;
+    {
+        std::lock_guard<std::mutex> lock(s_poolMutex);
+        if(!s_pool.empty())
+        {
+            instance = std::move(s_pool.back());
+            s_pool.pop_back();
+        }
+    }
+    if(!instance) instance.reset(new ParSplineCalc);
+    return InstanceLocker(instance.release(), clearMemory);
 }
 
-void ParSplineCalc::freeInstance()
+void ParSplineCalc::freeInstance(ParSplineCalc *instance)
 {
-    s_mutex.unlock();
+    std::lock_guard<std::mutex> lock(s_poolMutex);
+    s_pool.emplace_back(instance);
 }
 
 void ParSplineCalc::clear()
@@ -51,6 +59,7 @@ void ParSplineCalc::clear()
     e.reset(new VectorDouble);
     r.reset(new VectorDouble);
     bb.reset(new VectorDouble);
+    w.reset(new VectorDouble);
 }
 
 void ParSplineCalc::logSplinePoissonWeights
@@ -60,6 +69,8 @@ void ParSplineCalc::logSplinePoissonWeights
     double p
 )
 {
+    //Parameter searches and bootstraps stop here when their job is cancelled
+    Job::check();
     const size_t n = yIn.size();
     bb->resize(n);
     r->resize(n); //right-hand side values
@@ -147,6 +158,227 @@ void ParSplineCalc::logSplinePoissonWeights
     });
 }
 
+void ParSplineCalc::logSplinePoissonWeights
+(
+    std::vector<VectorDouble> &yOut,
+    const std::vector<VectorDouble> &yIn,
+    double p
+)
+{
+    Job::check();
+    const size_t nb = yIn.size();
+    yOut.resize(nb);
+    if(nb == 0) return;
+    const size_t n = yIn[0].size();
+    for(size_t k = 0; k < nb; ++k)
+    {
+        if(yIn[k].size() != n)
+            throw std::runtime_error("Spectra of a batch should have the same length!");
+        yOut[k].resize(n);
+    }
+
+    //Every group of spectra has its own contiguous block of n rows,
+    //element i of spectrum k of a group is stored at i*lanes + k
+    const size_t lanes = s_batchLanes;
+    const size_t nGroups = (nb + lanes - 1) / lanes;
+    for(VectorDoublePtr * v : {&a, &b, &c, &d, &e, &bb, &r, &w})
+        (*v)->resize(nGroups * lanes * n);
+
+    ThreadPool::parFor
+    (
+        nGroups,
+        [&](size_t g)->void
+    {
+        const size_t k0 = g * lanes;
+        const size_t nk = std::min(lanes, nb - k0);
+        const size_t off = g * lanes * n;
+        double * const W = w->data() + off;
+        double * const R = r->data() + off;
+
+        for(size_t i = 0; i < n; ++i)
+        {
+            double * wi = W + i * lanes;
+            double * ri = R + i * lanes;
+            for(size_t k = 0; k < nk; ++k)
+            {
+                const double * y = yIn[k0 + k].data();
+                wi[k] = y[i] < 1.0 ? p * (y[i] + 1.) * (y[i] + 1.)
+                    : p * (y[i] + 1.) * (y[i] + 1.) / y[i];
+                ri[k] = i == 0 || i == n - 1 ? 0.0
+                    : std::log((y[i - 1] + 1.) * (y[i + 1] + 1.)
+                        / (y[i] + 1.) / (y[i] + 1.));
+            }
+        }
+
+        //Same coefficients as in the single spectrum case, row by row
+        for(size_t i = 0; i < n; ++i)
+        {
+            const double * w0 = W + (i > 0 ? i - 1 : 0) * lanes;
+            const double * w1 = W + i * lanes;
+            const double * w2 = W + (i + 1 < n ? i + 1 : i) * lanes;
+            double * ci = c->data() + off + i * lanes;
+            for(size_t k = 0; k < nk; ++k)
+                ci[k] = i == 0 || i == n - 1 ? 1.0
+                    : w0[k] + 4.0*w1[k] + w2[k] + 4.0;
+            if(i + 1 < n)
+            {
+                double * bi = b->data() + off + i * lanes;
+                double * di = d->data() + off + i * lanes;
+                for(size_t k = 0; k < nk; ++k)
+                {
+                    bi[k] = i == n - 2 ? 0.0
+                        : i == 0 ? -w1[k] - 2.0*w2[k] + 1.0
+                        : -2.0*w1[k] - 2.0*w2[k] + 1.0;
+                    di[k] = i == n - 2 ? -2.0*w1[k] - w2[k] + 1.0
+                        : i == 0 ? 0.0
+                        : -2.0*w1[k] - 2.0*w2[k] + 1.0;
+                }
+            }
+            if(i + 2 < n)
+            {
+                double * ai = a->data() + off + i * lanes;
+                double * ei = e->data() + off + i * lanes;
+                for(size_t k = 0; k < nk; ++k)
+                {
+                    ai[k] = i == n - 3 ? 0.0 : w2[k];
+                    ei[k] = i == 0 ? 0.0 : w2[k];
+                }
+            }
+        }
+
+        math::fivediagonalsolvebatch
+        (
+            static_cast<int>(n),
+            static_cast<int>(nk),
+            static_cast<int>(lanes),
+            a->data() + off,
+            b->data() + off,
+            c->data() + off,
+            d->data() + off,
+            e->data() + off,
+            R,
+            bb->data() + off
+        );
+
+        for(size_t i = 0; i < n; ++i)
+        {
+            const double * wi = W + i * lanes;
+            const double * b0 = bb->data() + off + (i > 0 ? i - 1 : 0) * lanes;
+            const double * b1 = bb->data() + off + i * lanes;
+            const double * b2 = bb->data() + off + (i + 1 < n ? i + 1 : i) * lanes;
+            for(size_t k = 0; k < nk; ++k)
+            {
+                const double dd = i == 0 ? b2[k] - b1[k]
+                    : i == n - 1 ? b0[k] - b1[k]
+                    : b0[k] - 2.0*b1[k] + b2[k];
+                yOut[k0 + k][i] = std::exp(std::log(yIn[k0 + k][i] + 1.) - dd * wi[k]) - 1.;
+            }
+        }
+    }
+    );
+}
+
+double ParSplineCalc::logSplineGcv
+(
+    ParSplineCalc::VectorDouble &yOut,
+    const ParSplineCalc::VectorDouble &yIn,
+    double p
+)
+{
+    Job::check();
+    const size_t n = yIn.size();
+    yOut.resize(n);
+    if(n < 4)
+    {
+        yOut = yIn;
+        return 0.0;
+    }
+    w->resize(n);
+    r->resize(n);
+    bb->resize(n);
+    c->resize(n);
+    d->resize(n);
+    e->resize(n);
+    VectorDouble& W = *w;
+    VectorDouble& x = *bb;
+
+    ThreadPool::parFor
+    (
+        n,
+        [&](size_t i)->void
+    {
+        W[i] = yIn[i] < 1.0 ? p * (yIn[i] + 1.) * (yIn[i] + 1.)
+            : p * (yIn[i] + 1.) * (yIn[i] + 1.) / yIn[i];
+        (*r)[i] = i == 0 || i == n - 1 ? 0.0
+            : std::log((yIn[i - 1] + 1.) * (yIn[i + 1] + 1.)
+                / (yIn[i] + 1.) / (yIn[i] + 1.));
+    }
+    );
+
+    //Interior rows of the system are symmetric, after the factorization
+    //c keeps diagonal D, d and e keep subdiagonals of L
+    for(size_t i = 1; i < n - 1; ++i)
+    {
+        double mc = W[i - 1] + 4.0*W[i] + W[i + 1] + 4.0;
+        double md = i + 2 < n ? -2.0*W[i] - 2.0*W[i + 1] + 1.0 : 0.0;
+        const double me = i + 3 < n ? W[i + 1] : 0.0;
+        if(i > 1)
+        {
+            mc -= (*d)[i - 1] * (*d)[i - 1] * (*c)[i - 1];
+            md -= (*d)[i - 1] * (*e)[i - 1] * (*c)[i - 1];
+        }
+        if(i > 2) mc -= (*e)[i - 2] * (*e)[i - 2] * (*c)[i - 2];
+        (*c)[i] = mc;
+        (*d)[i] = md / mc;
+        (*e)[i] = me / mc;
+    }
+
+    x[0] = 0.0;
+    x[n - 1] = 0.0;
+    for(size_t i = 1; i < n - 1; ++i)
+    {
+        x[i] = (*r)[i];
+        if(i > 1) x[i] -= (*d)[i - 1] * x[i - 1];
+        if(i > 2) x[i] -= (*e)[i - 2] * x[i - 2];
+    }
+
+    //Backward substitution goes together with selected inversion:
+    //s11, s12, s22 are elements (i+1,i+1), (i+1,i+2), (i+2,i+2) of the inverse
+    double s11 = 0.0, s12 = 0.0, s22 = 0.0, trRInv = 0.0;
+    for(size_t i = n - 2; i > 0; --i)
+    {
+        const double l1 = (*d)[i], l2 = (*e)[i];
+        x[i] = x[i] / (*c)[i] - l1 * x[i + 1] - (i + 2 < n ? l2 * x[i + 2] : 0.0);
+        const double s01 = -(l1 * s11 + l2 * s12);
+        const double s02 = -(l1 * s12 + l2 * s22);
+        const double s00 = 1.0 / (*c)[i] - l1 * s01 - l2 * s02;
+        //Penalty matrix has 4 at diagonal and 1 at subdiagonals
+        trRInv += 4.0 * s00 + 2.0 * s01;
+        s22 = s11;
+        s12 = s01;
+        s11 = s00;
+    }
+
+    //Hat matrix is I - WQ(Q'WQ + R)^-1 Q', its trace is 2 + tr(R(Q'WQ + R)^-1)
+    const double trHat = 2.0 + trRInv;
+    const double rss = ThreadPool::parReduce
+    (
+        n,
+        0.0,
+        [&](size_t i)->double
+        {
+            const double qx = i == 0 ? x[1] - x[0]
+                : i == n - 1 ? x[n - 2] - x[n - 1]
+                : x[i - 1] - 2.0*x[i] + x[i + 1];
+            yOut[i] = std::exp(std::log(yIn[i] + 1.) - qx * W[i]) - 1.;
+            //Residual weights do not depend on the smoothness parameter
+            return p * W[i] * qx * qx;
+        },
+        std::plus<double>()
+    );
+    return n * rss / (n - trHat) / (n - trHat);
+}
+
 ParSplineCalc::InstanceLocker::InstanceLocker
 (
 	ParSplineCalc * instance,
@@ -159,11 +391,20 @@ ParSplineCalc::InstanceLocker::InstanceLocker
 
 }
 
+ParSplineCalc::InstanceLocker::InstanceLocker(InstanceLocker &&other)
+	:
+	m_instance(other.m_instance),
+	m_clearMemory(other.m_clearMemory)
+{
+	other.m_instance = nullptr;
+}
+
 ParSplineCalc::InstanceLocker::~InstanceLocker()
 {
+	if (!m_instance) return;
 	if (m_clearMemory)
 	{
         m_instance->clear();
 	}
-    m_instance->freeInstance();
+    freeInstance(m_instance);
 }
@@ -2,13 +2,16 @@
 #define PARSPLINECALC_H
 
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <QObject>
 
-class QMutex;
-
 /**
  * @brief The ParSplineCalc class calculates spline in parallel using
- * optimized memory consumption. Error checking is minimal
+ * optimized memory consumption. Error checking is minimal.
+ * Instances are solver workspaces kept in a pool: every caller checks out
+ * its own one, so smoothings run concurrently, and work vectors keep their
+ * capacity between calls
  */
 class ParSplineCalc : public QObject
 {
@@ -20,15 +23,18 @@ public:
 
     friend class InstanceLocker;
 	/**
-	* @brief The InstanceLocker class locks and unlocks ParSplineCalc instance
-	* automatically
+	* @brief The InstanceLocker class returns checked out ParSplineCalc
+	* instance to the pool automatically
 	*/
 	class InstanceLocker
 	{
 		ParSplineCalc * m_instance;
 		bool m_clearMemory;
 	public:
-		InstanceLocker(ParSplineCalc * instance = nullptr, bool clearMemory = true);
+		InstanceLocker(ParSplineCalc * instance = nullptr, bool clearMemory = false);
+		InstanceLocker(InstanceLocker&& other);
+		InstanceLocker(const InstanceLocker&) = delete;
+		InstanceLocker& operator=(const InstanceLocker&) = delete;
 
 		~InstanceLocker();
 
@@ -46,15 +52,17 @@ public:
     ~ParSplineCalc();
 
     /**
-     * @brief getInstance locks mutex
+     * @brief lockInstance checks out a workspace from the pool, new one is
+     * created if all of them are in use
+     * @param clearMemory frees work vectors when the workspace is returned
      * @return
      */
-    static InstanceLocker lockInstance(bool clearMemory = true);
+    static InstanceLocker lockInstance(bool clearMemory = false);
 
     /**
-     * @brief freeInstance releases mutex
+     * @brief freeInstance returns workspace to the pool
      */
-    static void freeInstance();
+    static void freeInstance(ParSplineCalc * instance);
 
     /**
      * @brief clear frees allocated memory
@@ -75,6 +83,38 @@ public:
         double p
     );
 
+    /**
+     * @brief logSplinePoissonWeights smoothes a batch of spectra of the same
+     * length with one parameter. Spectra are processed by groups of
+     * s_batchLanes, systems of a group are eliminated together
+     * @param yOut - smoothed spectra, resized to match yIn
+     * @param yIn - spectra to smooth
+     * @param p - smoothness parameter
+     */
+    void logSplinePoissonWeights
+    (
+        std::vector<VectorDouble>& yOut,
+        const std::vector<VectorDouble>& yIn,
+        double p
+    );
+
+    /**
+     * @brief logSplineGcv smoothes the same way as logSplinePoissonWeights,
+     * the system is solved by LDLt factorization which also gives the band of
+     * its inverse by selected inversion, so the trace of the hat matrix is
+     * found in O(n)
+     * @return generalized cross-validation score of the smoothing
+     */
+    double logSplineGcv
+    (
+        VectorDouble& yOut,
+        const VectorDouble& yIn,
+        double p
+    );
+
+    //Number of spectra processed together by one thread
+    static const size_t s_batchLanes = 8;
+
 signals:
     /**
      * @brief sendTextMessage sends outside text messages in emergency cases
@@ -83,14 +123,15 @@ signals:
     void sendTextMessage(QString msg);
 
 private:
-    //Vectors to store matrix values
-    VectorDoublePtr a, b, c, d, e, bb, r;
+    //Vectors to store matrix values, w keeps weights of batch calls
+    VectorDoublePtr a, b, c, d, e, bb, r, w;
 
     /**
-     * @brief s_mutex blocks current instance,
-     * because it has shared resources
+     * @brief s_pool workspaces which are not in use, s_poolMutex guards
+     * only check out and return
      */
-    static QMutex s_mutex;
+    static std::mutex s_poolMutex;
+    static std::vector<std::unique_ptr<ParSplineCalc>> s_pool;
 };
 
 #endif // PARSPLINECALC_H
@@ -1,5 +1,6 @@
 #include "LogSplinePoissonWeight.h"
 #include "alglibspline.h"
+#include "Base/ThreadPool.h"
 
 QMap<QString, Smoother::Type> Smoother::s_registry
 {
@@ -7,7 +8,8 @@ QMap<QString, Smoother::Type> Smoother::s_registry
     {"LogSplinePoissonWeightPoissonNoiseType", Smoother::LogSplinePoissonWeightPoissonNoiseType},
     {"LogSplinePoissonWeightOnePeakType", Smoother::LogSplinePoissonWeightOnePeakType},
     {"LogSplineFixNoiseValue", Smoother::LogSplineFixNoiseValue},
-    {"AlglibSpline", Smoother::AlglibSplineType}
+    {"AlglibSpline", Smoother::AlglibSplineType},
+    {"LogSplineGcv", Smoother::LogSplineGcvType}
 };
 
 QStringList Smoother::s_typeStrings
@@ -16,7 +18,8 @@ QStringList Smoother::s_typeStrings
     "LogSplinePoissonWeightPoissonNoiseType",
     "LogSplinePoissonWeightOnePeakType",
     "LogSplineFixNoiseValue",
-    "AlglibSpline"
+    "AlglibSpline",
+    "LogSplineGcv"
 };
 
 Smoother::Smoother(const QVariantMap &pars, QVariantMap &&parsTemp)
@@ -62,6 +65,8 @@ Smoother::Pointer Smoother::create
         return Pointer(new LSFixNoiseValue(pars));
     case AlglibSplineType:
         return Pointer(new AlglibSpline(pars));
+    case LogSplineGcvType:
+        return Pointer(new LogSplineGcv(pars));
     }
     return Pointer();
 }
@@ -106,12 +111,30 @@ double Smoother::sqDif
     const VectorDouble &y2
 )
 {
-    double res = 0;
-    for(size_t i = 0; i < y1.size(); ++i)
-    {
-        res += (y1[i] - y2[i]) * (y1[i] - y2[i]);
-    }
-    return res;
+    return ThreadPool::parReduce
+    (
+        y1.size(),
+        0.0,
+        [&](size_t i)->double
+        {
+            return (y1[i] - y2[i]) * (y1[i] - y2[i]);
+        },
+        std::plus<double>()
+    );
+}
+
+double Smoother::sum(const VectorDouble &y)
+{
+    return ThreadPool::parReduce
+    (
+        y.size(),
+        0.0,
+        [&](size_t i)->double
+        {
+            return y[i];
+        },
+        std::plus<double>()
+    );
 }
 
 double Smoother::std(const Smoother::VectorDouble &y1, const Smoother::VectorDouble &y2)
@@ -31,7 +31,8 @@ public:
         LogSplinePoissonWeightPoissonNoiseType,
         LogSplinePoissonWeightOnePeakType,
         LogSplineFixNoiseValue,
-        AlglibSplineType
+        AlglibSplineType,
+        LogSplineGcvType
     };
 
     static Pointer create(Type type, const QVariantMap& pars = QVariantMap());
@@ -119,6 +120,14 @@ protected:
         const VectorDouble& y2
     );
 
+    /**
+     * @brief sum sum of array values, the result does not depend on number
+     * of threads
+     * @param y
+     * @return
+     */
+    static double sum(const VectorDouble& y);
+
     //Standart square deviation
     static double std
     (
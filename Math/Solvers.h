@@ -3,6 +3,9 @@
 
 #include "exception.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <sstream>
 
 namespace math
@@ -92,22 +95,236 @@ namespace math
     }
 
     /**
-     * simple bisection solver
+     * Solves several five diagonal systems of the same size at once, the
+     * elimination runs across systems so inner loops vectorize.
+     * Element i of system k is stored at i*stride + k, arrays have the same
+     * meaning as in fivediagonalsolve
+     */
+    template<class DataType> int fivediagonalsolvebatch
+        (
+            int n,          //number of equations
+            int lanes,      //number of systems
+            int stride,     //distance between rows, not less than lanes
+            DataType* a,
+            DataType* b,
+            DataType* c,    //main diagonal
+            DataType* d,
+            DataType* e,
+            DataType* r,    //right-hand part
+            DataType* x     //solution
+        ) throw()
+    {
+        const size_t s = static_cast<size_t>(stride);
+        for(int i = 0; i < n-2; i++)
+        {
+            const DataType* ai = a + i*s;
+            DataType* bi1 = b + (i+1)*s;
+            const DataType* bi = b + i*s;
+            const DataType* ci = c + i*s;
+            DataType* ci1 = c + (i+1)*s;
+            DataType* ci2 = c + (i+2)*s;
+            const DataType* di = d + i*s;
+            DataType* di1 = d + (i+1)*s;
+            const DataType* ei = e + i*s;
+            const DataType* ri = r + i*s;
+            DataType* ri1 = r + (i+1)*s;
+            DataType* ri2 = r + (i+2)*s;
+            for(int k = 0; k < lanes; k++)
+            {
+                DataType m1 = bi[k]/ci[k];
+                DataType m2 = ai[k]/ci[k];
+                ci1[k] = ci1[k] - m1*di[k];
+                di1[k] = di1[k] - m1*ei[k];
+                bi1[k] = bi1[k] - m2*di[k];
+                ci2[k] = ci2[k] - m2*ei[k];
+                ri1[k] = ri1[k] - m1*ri[k];
+                ri2[k] = ri2[k] - m2*ri[k];
+            }
+        }
+        {
+            const DataType* bl = b + (n-2)*s;
+            const DataType* cl = c + (n-2)*s;
+            DataType* cn = c + (n-1)*s;
+            const DataType* dl = d + (n-2)*s;
+            const DataType* rl = r + (n-2)*s;
+            DataType* rn = r + (n-1)*s;
+            DataType* xl = x + (n-2)*s;
+            DataType* xn = x + (n-1)*s;
+            for(int k = 0; k < lanes; k++)
+            {
+                DataType m3 = bl[k]/cl[k];
+                cn[k] = cn[k] - m3*dl[k];
+                rn[k] = rn[k] - m3*rl[k];
+                xn[k] = rn[k] / cn[k];
+                xl[k] = (rl[k] - dl[k]*xn[k]) / cl[k];
+            }
+        }
+
+        for(int i = n-3; i >= 0; i--)
+        {
+            const DataType* ci = c + i*s;
+            const DataType* di = d + i*s;
+            const DataType* ei = e + i*s;
+            const DataType* ri = r + i*s;
+            DataType* xi = x + i*s;
+            const DataType* xi1 = x + (i+1)*s;
+            const DataType* xi2 = x + (i+2)*s;
+            for(int k = 0; k < lanes; k++)
+                xi[k] = (ri[k] - di[k]*xi1[k] - ei[k]*xi2[k]) / ci[k];
+        }
+
+        return 0;
+    }
+
+    /**
+     * Brent root solver on the bracket [a, b] where fa = fun(a) and
+     * fb = fun(b) have different signs and are already known.
+     * Function is evaluated once per iteration, tol is absolute
+     */
+    template<class Fun>
+    double brent(Fun fun, double a, double b, double fa, double fb, double tol)
+    {
+        const int maxIter = 100;
+        double c = b, fc = fb, d = b - a, e = d;
+        for(int i = 0; i < maxIter; ++i)
+        {
+            if((fb > 0.0) == (fc > 0.0))
+            {
+                c = a; fc = fa;
+                e = d = b - a;
+            }
+            if(std::fabs(fc) < std::fabs(fb))
+            {
+                a = b; b = c; c = a;
+                fa = fb; fb = fc; fc = fa;
+            }
+            const double tol1 = 2.0 * std::numeric_limits<double>::epsilon()
+                    * std::fabs(b) + 0.5 * tol;
+            const double xm = 0.5 * (c - b);
+            if(std::fabs(xm) <= tol1 || fb == 0.0) return b;
+            if(std::fabs(e) >= tol1 && std::fabs(fa) > std::fabs(fb))
+            {
+                //Secant or inverse quadratic interpolation
+                double p, q;
+                const double s = fb / fa;
+                if(a == c)
+                {
+                    p = 2.0 * xm * s;
+                    q = 1.0 - s;
+                }
+                else
+                {
+                    const double r = fb / fc;
+                    q = fa / fc;
+                    p = s * (2.0 * xm * q * (q - r) - (b - a) * (r - 1.0));
+                    q = (q - 1.0) * (r - 1.0) * (s - 1.0);
+                }
+                if(p > 0.0) q = -q;
+                p = std::fabs(p);
+                if(2.0 * p < std::min(3.0 * xm * q - std::fabs(tol1 * q), std::fabs(e * q)))
+                {
+                    e = d;
+                    d = p / q;
+                }
+                else
+                {
+                    d = xm;
+                    e = d;
+                }
+            }
+            else
+            {
+                d = xm;
+                e = d;
+            }
+            a = b;
+            fa = fb;
+            b += std::fabs(d) > tol1 ? d : (xm > 0.0 ? tol1 : -tol1);
+            fb = fun(b);
+        }
+        return b;
+    }
+
+    /**
+     * Root solver on the bracket [a, b], if there is no root inside
+     * the end with smaller function value is returned
      */
     template<class Fun>
     double froot(Fun fun, double a, double b)
     {
-        if(fun(a) > fun(b)) std::swap(a, b);
-        if(fun(a) * fun(b) > 0.0)
-            return std::fabs(fun(a)) > std::fabs(fun(b)) ? b : a;
-        while(std::fabs((b - a) / (b + a)) > 1e-12)
+        const double fa = fun(a), fb = fun(b);
+        if(fa == 0.0) return a;
+        if(fb == 0.0) return b;
+        if(fa * fb > 0.0)
+            return std::fabs(fa) > std::fabs(fb) ? b : a;
+        return brent(fun, a, b, fa, fb, 1e-12 * std::fabs(b + a));
+    }
+
+    /**
+     * Root solver for function of positive argument which increases with it.
+     * Bracket is searched in log scale starting from the guess x0, usually
+     * previous solution, with steps growing from the factor step. Then root is
+     * refined in log scale, so every point is evaluated once.
+     * If bracket is not found the last tried point is returned
+     */
+    template<class Fun>
+    double frootlog(Fun fun, double x0, double step = 2.0)
+    {
+        const int maxSteps = 8;
+        if(!(x0 > 0.0)) x0 = 1.0;
+        double u0 = std::log(x0);
+        double f0 = fun(x0);
+        if(f0 == 0.0) return x0;
+        double h = f0 > 0.0 ? -std::log(step) : std::log(step);
+        for(int i = 0; i < maxSteps; ++i, h *= 2.0)
+        {
+            const double u1 = u0 + h;
+            const double f1 = fun(std::exp(u1));
+            if(f1 == 0.0) return std::exp(u1);
+            if((f0 > 0.0) != (f1 > 0.0))
+            {
+                return std::exp(brent
+                (
+                    [&](double u)->double { return fun(std::exp(u)); },
+                    u0, u1, f0, f1, 1e-12
+                ));
+            }
+            u0 = u1;
+            f0 = f1;
+        }
+        return std::exp(u0);
+    }
+
+    /**
+     * Golden section search of minimum of unimodal function on [a, b],
+     * one evaluation per step
+     */
+    template<class Fun>
+    double goldenmin(Fun fun, double a, double b, double tol)
+    {
+        const double g = 0.5 * (std::sqrt(5.0) - 1.0);
+        double x1 = b - g * (b - a), x2 = a + g * (b - a);
+        double f1 = fun(x1), f2 = fun(x2);
+        while(std::fabs(b - a) > tol)
         {
-            double m = .5 * (a + b);
-            if(fun(m) == 0.0) return m;
-            else if(fun(m) > 0.0) b = m;
-            else a = m;
+            if(f1 < f2)
+            {
+                b = x2;
+                x2 = x1;
+                f2 = f1;
+                x1 = b - g * (b - a);
+                f1 = fun(x1);
+            }
+            else
+            {
+                a = x1;
+                x1 = x2;
+                f1 = f2;
+                x2 = a + g * (b - a);
+                f2 = fun(x2);
+            }
         }
-        return .5 * (a + b);
+        return f1 < f2 ? x1 : x2;
     }
 }
 
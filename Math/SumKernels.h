@@ -0,0 +1,123 @@
+#ifndef SUMKERNELS_H
+#define SUMKERNELS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+
+namespace math
+{
+    /**
+     * Summation kernels for mass spectra. Dense data is an array of
+     * intensities where element i keeps the bin first + i, sparse data is
+     * a range of (bin, intensity) pairs sorted by bin
+     */
+
+    /*dense += dense over the overlap of two bin ranges*/
+    template<class Acc, class Val>
+    void addDenseToDense
+        (
+            Acc* acc,          //accumulator
+            int64_t accFirst,  //bin of acc[0]
+            size_t accN,       //number of bins in acc
+            const Val* src,
+            int64_t srcFirst,  //bin of src[0]
+            size_t srcN
+        )
+    {
+        const int64_t t0 = std::max(accFirst, srcFirst);
+        const int64_t t1 = std::min
+            (
+                accFirst + static_cast<int64_t>(accN),
+                srcFirst + static_cast<int64_t>(srcN)
+            );
+        if(t0 >= t1) return;
+        Acc* dst = acc + (t0 - accFirst);
+        const Val* s = src + (t0 - srcFirst);
+        const int64_t n = t1 - t0;
+        for(int64_t i = 0; i < n; ++i)
+        {
+            dst[i] += s[i];
+        }
+    }
+
+    /*first pair with bin not less than t, binary search needs random access*/
+    template<class It>
+    It skipBinsBefore(It first, It last, int64_t t, std::random_access_iterator_tag)
+    {
+        return std::lower_bound
+            (
+                first, last, t,
+                [](typename std::iterator_traits<It>::reference p, int64_t b)->bool
+                {
+                    return static_cast<int64_t>(p.first) < b;
+                }
+            );
+    }
+
+    /*other iterators are walked, callers like std::map pass lower_bound*/
+    template<class It>
+    It skipBinsBefore(It first, It last, int64_t t, std::input_iterator_tag)
+    {
+        while(first != last && static_cast<int64_t>(first->first) < t) ++first;
+        return first;
+    }
+
+    /*dense += sparse, pairs outside of accumulator are skipped*/
+    template<class Acc, class It>
+    void addSparseToDense
+        (
+            Acc* acc,
+            int64_t accFirst,
+            size_t accN,
+            It first,          //sorted range of (bin, intensity) pairs
+            It last
+        )
+    {
+        const int64_t accLast = accFirst + static_cast<int64_t>(accN);
+        first = skipBinsBefore
+            (
+                first, last, accFirst,
+                typename std::iterator_traits<It>::iterator_category()
+            );
+        for(; first != last && static_cast<int64_t>(first->first) < accLast; ++first)
+        {
+            acc[static_cast<int64_t>(first->first) - accFirst] += first->second;
+        }
+    }
+
+    /*sparse + sparse merge-join, equal bins are summed*/
+    template<class It1, class It2, class Out>
+    Out mergeSparse
+        (
+            It1 first1,
+            It1 last1,
+            It2 first2,
+            It2 last2,
+            Out out            //receives (bin, intensity) pairs in bin order
+        )
+    {
+        while(first1 != last1 && first2 != last2)
+        {
+            if(first1->first < first2->first)
+            {
+                *out++ = *first1++;
+            }
+            else if(first2->first < first1->first)
+            {
+                *out++ = *first2++;
+            }
+            else
+            {
+                typename std::iterator_traits<It1>::value_type v = *first1++;
+                v.second += (first2++)->second;
+                *out++ = v;
+            }
+        }
+        out = std::copy(first1, last1, out);
+        return std::copy(first2, last2, out);
+    }
+}
+
+#endif // SUMKERNELS_H
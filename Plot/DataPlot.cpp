@@ -6,6 +6,7 @@
 #include "Math/alglib/interpolation.h"
 #include "../QMapPropsDialog.h"
 #include "Base/BaseObject.h"
+#include "Base/Job.h"
 #include "DataPlot.h"
 #include "BasePlot.h"
 #include "Math/LogSplinePoissonWeight.h"
@@ -125,7 +126,15 @@ void DataPlot::calculateSmoothing()
                 0.
             );
 
-            mSmoother->run(ySmoothed, y);
+            if
+            (
+                !Job::runModal
+                (
+                    this,
+                    tr("Smoothing"),
+                    [&]()->void { mSmoother->run(ySmoothed, y); }
+                )
+            ) return;
 
             addPlot
             (
@@ -179,6 +188,14 @@ void DataPlot::calculateSmoothing()
                             )
                 );
             }
+            if(mSmoother->type() == Smoother::LogSplineGcvType)
+            {
+                showInfoMessage
+                (
+                    tr("Smoothing parameter: %1")
+                            .arg(mSmoother->params()[SMOOTH_PARAM].toDouble())
+                );
+            }
         }
     }
     catch (const std::exception& e)
@@ -343,9 +360,11 @@ void DataPlot::on_createPeakShape()
             (
                 "Peak position: %1\n"
                 "Peak position uncertainty: %2\n"
+                "Fisher information uncertainty: %3\n"
             )
                     .arg(mPeakShape->peakPosition(), 0, 'g', 10)
                     .arg(mPeakShape->peakPositionUncertainty(), 0, 'g', 3)
+                    .arg(mPeakShape->peakPositionFisherError(), 0, 'g', 3)
         );
     }
     else
@@ -369,9 +388,11 @@ void DataPlot::on_createPeakShape()
             (
                 "Peak position: %1\n"
                 "Peak position uncertainty: %2\n"
+                "Fisher information uncertainty: %3\n"
             )
                     .arg(mPeakShape->peakPosition(), 0, 'g', 10)
                     .arg(mPeakShape->peakPositionUncertainty(), 0, 'g', 3)
+                    .arg(mPeakShape->peakPositionFisherError(), 0, 'g', 3)
         );
     }
 }
@@ -392,9 +413,11 @@ void DataPlot::on_fitPeakShape()
             (
                 "PeakPosition: %1\n"
                 "Peak uncertainty: %2\n"
+                "Fisher information uncertainty: %3\n"
             )
                     .arg(mPeakShape->peakPosition(), 0, 'g', 10)
                     .arg(mPeakShape->peakPositionUncertainty(), 0, 'g', 3)
+                    .arg(mPeakShape->peakPositionFisherError(), 0, 'g', 3)
         );
 
         mPeakShape->values(x, y);
@@ -436,15 +459,17 @@ void DataPlot::on_fitDoublePeakShape()
                 tr
                 (
                     "Peak position1: %1\n"
-                    "Peak uncertainty1: %2\n"
-                    "Peak position2: %3 \n"
-                    "Peak uncertainty2: %4\n"
+                    "Peak uncertainty1: %2 (Fisher: %3)\n"
+                    "Peak position2: %4 \n"
+                    "Peak uncertainty2: %5 (Fisher: %6)\n"
                     "Do you want to make another run?"
                 )
                     .arg(fit.peakPosition1(), 0, 'g', 10)
                     .arg(fit.peakPositionUncertainty1(), 0, 'g', 3)
+                    .arg(fit.peakPositionFisherError1(), 0, 'g', 3)
                     .arg(fit.peakPosition2(), 0, 'g', 10)
                     .arg(fit.peakPositionUncertainty2(), 0, 'g', 3)
+                    .arg(fit.peakPositionFisherError2(), 0, 'g', 3)
             ) == QMessageBox::Yes
         )
         {
@@ -1,8 +1,10 @@
 #include "PlotPair.h"
 #include "Base/BaseObject.h"
+#include "Base/Job.h"
 #include "Data/MassSpec.h"
 #include "Data/TimeEvents.h"
 #include "Data/XValsTransform.h"
+#include "MassSpecAccDialogs.h"
 #include <QInputDialog>
 
 PlotPair::PlotPair(QWidget *parent) :
@@ -44,6 +46,14 @@ PlotPair::PlotPair(QWidget *parent) :
         SLOT(onSelectData())
     );
 
+    mMsPlot->toolBar()->addAction
+    (
+        QIcon("://Icons//xcorr"),
+        "Drift corrected accumulation",
+        this,
+        SLOT(onDriftCorrectedSum())
+    );
+
     mTicPlot->xAxis->setLabel(tr("Mass spectrum number"));
 
     addToolBar(Qt::TopToolBarArea, mMsPlot->toolBar());
@@ -304,17 +314,28 @@ void PlotPair::selectTicData()
         size_t minX = xrange.lower >= 0 ? static_cast<size_t>(xrange.lower) : 0;
         size_t maxX = xrange.upper < n ? static_cast<size_t>(xrange.upper + 1) : n;
 
-        MapIntInt msDataMap = DirectSum().accum(ms, minX, maxX);
-
-        QVector<double> x(msDataMap.size()), y(msDataMap.size());
-
-        int i = 0;
-        for(MapIntInt::const_reference d : msDataMap)
+        MassSpectrumsCollection::StorePtr store = ms->store();
+        const int minBin = store->minBin();
+        std::vector<int64_t> acc;
+        const bool done = Job::runModal(this, tr("Mass spectra accumulation"), [&]()
         {
-            x[i] = d.first;
-            y[i] = d.second;
-            ++i;
-        }
+            acc = DirectSum::accumDense
+            (
+                *store,
+                minX,
+                std::min(maxX, store->size()),
+                minBin,
+                store->maxBin()
+            );
+        });
+        if(!done) return;
+
+        QVector<double> x, y;
+        DirectSum::compressGaps(acc, minBin, [&](int bin, int64_t val)
+        {
+            x.push_back(bin);
+            y.push_back(static_cast<double>(val));
+        });
 
         Q_EMIT dataSelected
         (
@@ -325,3 +346,58 @@ void PlotPair::selectTicData()
         );
     }
 }
+
+void PlotPair::onDriftCorrectedSum()
+{
+    MassSpectrumsCollection * ms = MyInit::instance()->massSpecColl();
+    MassSpectrumsCollection::StorePtr store = ms->store();
+    if(store->size() == 0) return;
+    AccumScaleCorrectionDialog dialog(static_cast<int>(store->size()), this);
+    if(dialog.exec() != QDialog::Accepted) return;
+    AccumScaleCorrectionDialog::DialogReturnParams params = dialog.getDialogParams();
+
+    //Reference peak is searched in the visible part of mass spectrum
+    QCPRange xrange = mMsPlot->xAxis->range();
+    DriftCorrectedSum sum
+    (
+        params.step,
+        static_cast<int>(params.peakWidth),
+        static_cast<int>(mXValsTransform->invTransform(::round(xrange.lower))),
+        static_cast<int>(mXValsTransform->invTransform(::round(xrange.upper)))
+    );
+    const size_t first = params.minSweepIdx;
+    const size_t last = std::min(params.maxSweepIdx, store->size());
+    const int minBin = store->minBin();
+    std::vector<double> acc;
+    const bool done = Job::runModal(this, tr("Drift corrected accumulation"), [&]()
+    {
+        acc = sum.accumDense(*store, first, last, minBin, store->maxBin());
+    });
+    if(!done) return;
+
+    QVector<double> x, y;
+    DirectSum::compressGaps(acc, minBin, [&](int bin, double val)
+    {
+        x.push_back(bin);
+        y.push_back(val);
+    });
+    Q_EMIT dataSelected
+    (
+        x,
+        y,
+        tr("Drift corrected MS indexes: %1 - %2").arg(first).arg(last),
+        mMsPlot->xAxis->label()
+    );
+
+    const std::vector<double>& shifts = sum.shifts();
+    QVector<double> blocks(static_cast<int>(shifts.size()));
+    for(int i = 0; i < blocks.size(); ++i)
+        blocks[i] = first + i * (params.step == 0 ? last - first : params.step);
+    Q_EMIT dataSelected
+    (
+        blocks,
+        QVector<double>::fromStdVector(shifts),
+        tr("Drift shifts in bins for MS indexes: %1 - %2").arg(first).arg(last),
+        mTicPlot->xAxis->label()
+    );
+}
@@ -56,6 +56,12 @@ private slots:
     void selectMsData();
 
     void selectTicData();
+
+    /**
+     * @brief onDriftCorrectedSum accumulates mass spectra with drift correction
+     * and plots corrected mass spectrum together with shifts of blocks
+     */
+    void onDriftCorrectedSum();
 private:
     QPointer<BasePlot> mMsPlot;
 
@@ -4,6 +4,7 @@
 #include <QMdiSubWindow>
 #include <QFileDialog>
 #include <QMessageBox>
+#include <QtConcurrent>
 #include "Data/Reader.h"
 
 #include "DialogAbout.h"
@@ -19,16 +20,26 @@
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
-    mProgressBar(new QProgressBar)
+    mProgressBar(new QProgressBar),
+    mCancelButton(new QPushButton(tr("Cancel")))
 {
     ui->setupUi(this);
     setCentralWidget(ui->mdiArea);
     mProgressBar->hide();
+    mCancelButton->hide();
     statusBar()->addWidget(mProgressBar);
+    statusBar()->addWidget(mCancelButton);
 }
 
 MainWindow::~MainWindow()
 {
+    if(mLoadJob) mLoadJob->cancel();
+    //Loads waiting for their start are never run
+    if(mRunningJob)
+    {
+        mRunningJob->cancel();
+        mRunningJob->wait();
+    }
     delete ui;
 }
 
@@ -68,23 +79,117 @@ void MainWindow::on_actionOpenDataFile_triggered()
     }
 }
 
+void MainWindow::chooseStorage(qint64 nBytes)
+{
+    //Big acquisitions are spilled to scratch file not to run out of RAM
+    const qint64 maxInMemoryBytes = qint64(2) << 30;
+    MyInit::instance()->massSpecColl()->setStorage
+    (
+        nBytes > maxInMemoryBytes ?
+                    PackArena::MappedFileStorage : PackArena::MemoryStorage
+    );
+}
+
+Job::Ptr MainWindow::startLoad(const QString &name)
+{
+    //Data of the previous load is dropped by the new one
+    if(mLoadJob)
+    {
+        mLoadJob->cancel();
+        disconnect(mLoadJob.get(), nullptr, mProgressBar.data(), nullptr);
+        disconnect(mLoadJob.get(), nullptr, mCancelButton.data(), nullptr);
+        disconnect(mCancelButton.data(), nullptr, mLoadJob.get(), nullptr);
+        //Finished of the job still launches the next load, so only errors are muted
+        disconnect(mLoadJob.get(), &Job::failed, this, nullptr);
+    }
+    mLoadJob.reset(new Job(name));
+    connect(mLoadJob.get(), SIGNAL(progressNotify(int)), mProgressBar.data(), SLOT(setValue(int)));
+    connect(mLoadJob.get(), SIGNAL(finished()), mProgressBar.data(), SLOT(hide()));
+    connect(mLoadJob.get(), SIGNAL(finished()), mCancelButton.data(), SLOT(hide()));
+    connect(mCancelButton.data(), SIGNAL(clicked()), mLoadJob.get(), SLOT(cancel()));
+    //Context object makes the connection queued to the GUI thread
+    connect(mLoadJob.get(), &Job::failed, this, [this, name](const QString& message)
+    {
+        QMessageBox::warning(this, name, message);
+    });
+    mProgressBar->setValue(0);
+    mProgressBar->show();
+    mCancelButton->show();
+    return mLoadJob;
+}
+
+void MainWindow::runLoad(const Job::Ptr &job, std::function<void ()> load)
+{
+    Job::Ptr previous = mRunningJob;
+    std::shared_ptr<bool> launched(new bool(false));
+    auto launch = [this, job, load, launched]()
+    {
+        if(*launched) return;
+        *launched = true;
+        //Superseded before the previous load has released its data
+        if(job->isCancelled())
+        {
+            job->finish();
+            return;
+        }
+        mRunningJob = job;
+        start(job, load);
+    };
+    if(!previous)
+    {
+        launch();
+        return;
+    }
+    //Connection goes first so that finish between it and the check is not lost
+    connect(previous.get(), &Job::finished, this, launch, Qt::QueuedConnection);
+    if(previous->isFinished()) launch();
+}
+
+void MainWindow::start(const Job::Ptr &job, std::function<void ()> load)
+{
+    QtConcurrent::run([job, load]()
+    {
+        Job::Scope scope(job.get());
+        try
+        {
+            load();
+        }
+        catch(const Job::Cancelled&)
+        {
+        }
+        //Future is not kept, so errors are passed to the GUI by the job
+        catch(const std::exception& e)
+        {
+            job->fail(QString::fromLocal8Bit(e.what()));
+        }
+        catch(...)
+        {
+            job->fail(tr("Unknown error"));
+        }
+        job->finish();
+    });
+}
+
 void MainWindow::openRikenDataFile(const QString &fileName)
 {
+    Job::Ptr job = startLoad(tr("Loading ") + fileName);
+    chooseStorage(QFileInfo(fileName).size());
     createTicAndMsGraphs();
-    Reader * reader = new RikenFileReader;
+    std::shared_ptr<Reader> reader(new RikenFileReader);
+    reader->setJob(job);
     reader->open(fileName);
-    QThreadPool::globalInstance()->start(reader);
+    runLoad(job, [reader]{ reader->run(); });
 }
 
 void MainWindow::openRikenASCIIData(const QString &fileName)
 {
+    Job::Ptr job = startLoad(tr("Loading ") + fileName);
+    chooseStorage(QFileInfo(fileName).size());
     createTicAndMsGraphs();
-    Reader * reader = new DirectMsFromRikenTxt;
+    std::shared_ptr<Reader> reader(new DirectMsFromRikenTxt);
+    reader->setJob(job);
     reader->open(fileName);
-    connect(reader, SIGNAL(progressNotify(int)), mProgressBar.data(), SLOT(setValue(int)));
-    QThreadPool::globalInstance()->start(reader);
-    mProgressBar->show();
-    connect(reader, SIGNAL(finished()), mProgressBar.data(), SLOT(hide()));
+    runLoad(job, [reader]{ reader->run(); });
 }
 
 void MainWindow::openRikenDataFiles(const QStringList &fileNames)
@@ -94,20 +199,35 @@ void MainWindow::openRikenDataFiles(const QStringList &fileNames)
     progress->setMinimum(0);
     progress->setMaximum(fileNames.size());
     statusBar()->addWidget(progress);
+    Job::Ptr job = startLoad(tr("Loading files"));
+    qint64 nBytes = 0;
+    for(const QString& fileName : fileNames)
+        nBytes += QFileInfo(fileName).size();
+    chooseStorage(nBytes);
     createTicAndMsGraphs();
-    Reader * reader = new RikenFileReader;
-    MyInit::instance()->timeEvents()->blockingClear();
+    std::shared_ptr<Reader> reader(new RikenFileReader);
+    reader->setJob(job);
+    //Data is cleared once for all files
     reader->disconnect(SIGNAL(started()), MyInit::instance()->timeEvents(), SLOT(blockingClear()));
-    for(int i = 0; i < fileNames.size(); ++i)
+    //Reader starts files in the pool thread, the label follows in the GUI one
+    std::shared_ptr<int> nStarted(new int(0));
+    connect(reader.get(), &Reader::started, progress, [progress, fileNames, nStarted]()
     {
-        QFileInfo fileInfo(fileNames[i]);
-        progress->setFormat(tr("Loading ") + fileInfo.fileName());
-        progress->setValue(i);
-        reader->open(fileNames[i]);
-        reader->run();
-        reader->close();
-    }
-    statusBar()->removeWidget(progress);
+        progress->setFormat(tr("Loading ") + QFileInfo(fileNames[*nStarted]).fileName());
+        progress->setValue((*nStarted)++);
+    });
+    connect(job.get(), &Job::finished, progress, &QObject::deleteLater);
+    runLoad(job, [reader, fileNames]()
+    {
+        MyInit::instance()->timeEvents()->blockingClear();
+        for(const QString& fileName : fileNames)
+        {
+            Job::check();
+            reader->open(fileName);
+            reader->run();
+            reader->close();
+        }
+    });
 }
 
 void MainWindow::createTicAndMsGraphs()
@@ -131,14 +251,15 @@ void MainWindow::createTicAndMsGraphs()
 
 void MainWindow::openSpamsFile(const QString &fileName)
 {
-    MyInit::instance()->massSpecColl()->setMsType(MassSpecImpl::MassSpecVecType);
+    //Mass spectrum type is switched by the reader in the load task after
+    //the previous data is cleared, so nothing is repacked here
+    Job::Ptr job = startLoad(tr("Loading ") + fileName);
+    chooseStorage(QFileInfo(fileName).size());
     createTicAndMsGraphs();
-    Reader * reader = new SPAMSHexinDataX32;
-    mProgressBar->show();
+    std::shared_ptr<Reader> reader(new SPAMSHexinDataX32);
+    reader->setJob(job);
     reader->open(fileName);
-    QThreadPool::globalInstance()->start(reader);
-    connect(reader, SIGNAL(progress(int)), mProgressBar.data(), SLOT(setValue(int)));
-    connect(reader, SIGNAL(finished()), mProgressBar.data(), SLOT(hide()));
+    runLoad(job, [reader]{ reader->run(); });
 }
 
 void MainWindow::on_actionTileSubWindows_triggered()
@@ -156,9 +277,13 @@ void MainWindow::on_actionReaccumulate_mass_spectra_triggered()
         static_cast<int>(MyInit::instance()->timeEvents()->startsPerHist())
     );
 
+    Job::Ptr job = startLoad(tr("Reaccumulation"));
     createTicAndMsGraphs();
 
-    MyInit::instance()->timeEvents()->recalculateTimeSlices(static_cast<size_t>(val));
+    runLoad(job, [val]()
+    {
+        MyInit::instance()->timeEvents()->recalculateTimeSlices(static_cast<size_t>(val));
+    });
 
 }
 
@@ -201,9 +326,11 @@ void MainWindow::on_actionOpen_txt_from_folder_triggered()
             &ok
         );
         scope = ok ? scope : 1000;
-        Reader * reader = new TxtFileReader(scope);
+        Job::Ptr job = startLoad(tr("Loading ") + dir);
+        std::shared_ptr<Reader> reader(new TxtFileReader(scope));
+        reader->setJob(job);
         reader->open(dir);
-        QThreadPool::globalInstance()->start(reader);
+        runLoad(job, [reader]{ reader->run(); });
     }
 }
 
@@ -3,7 +3,11 @@
 
 #include <QMainWindow>
 #include <QProgressBar>
+#include <QPushButton>
 #include <QPointer>
+#include <functional>
+
+#include "Base/Job.h"
 
 namespace Ui {
 class MainWindow;
@@ -54,8 +58,35 @@ private:
     void createTicAndMsGraphs();
 
     void openSpamsFile(const QString& fileName);
+
+    /**
+     * @brief chooseStorage selects storage of mass spectra collection by the size of data
+     * @param nBytes
+     */
+    void chooseStorage(qint64 nBytes);
+
+    /**
+     * @brief startLoad cancels the previous load and creates job for the
+     * new one, the GUI thread is never blocked by the cancelled load
+     * @param name
+     * @return
+     */
+    Job::Ptr startLoad(const QString& name);
+
+    /**
+     * @brief runLoad runs load in a pooled task within job and finishes
+     * the job when load returns. The task is started when the previously
+     * running load has finished
+     */
+    void runLoad(const Job::Ptr& job, std::function<void()> load);
+    static void start(const Job::Ptr& job, std::function<void()> load);
 private:
     QPointer<QProgressBar> mProgressBar;
+    QPointer<QPushButton> mCancelButton;
+    //Job which fills mass spectra collection
+    Job::Ptr mLoadJob;
+    //Last job whose task was started in the pool
+    Job::Ptr mRunningJob;
 };
 
 #endif // MAINWINDOW_H
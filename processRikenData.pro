@@ -27,6 +27,7 @@ SOURCES += main.cpp\
     DialogAbout.cpp \
     Base/BaseObject.cpp \
     Base/ThreadPool.cpp \
+    Base/Job.cpp \
     Plot/BasePlot.cpp \
     Data/Reader.cpp \
     Data/TimeEvents.cpp \
@@ -36,6 +37,9 @@ SOURCES += main.cpp\
     Math/MassSpecSummator.cpp \
     Plot/DataPlot.cpp \
     Math/CurveFitting.cpp \
+    Math/MonteCarlo.cpp \
+    Math/FisherInformation.cpp \
+    Math/LevenbergMarquardt.cpp \
     Math/alglib/alglibinternal.cpp \
     Math/alglib/alglibmisc.cpp \
     Math/alglib/ap.cpp \
@@ -51,6 +55,11 @@ SOURCES += main.cpp\
     Math/alglib/statistics.cpp \
     Data/MassSpecImpl.cpp \
     Data/PackProc.cpp \
+    Data/PackArena.cpp \
+    Data/MassSpecCache.cpp \
+    Data/MassSpecBuilder.cpp \
+    Data/MassSpecStore.cpp \
+    Data/Ingest.cpp \
     Math/peakparams.cpp \
     Math/alglibspline.cpp
 
@@ -69,6 +78,8 @@ HEADERS  += mainwindow.h \
     DialogAbout.h \
     Base/BaseObject.h \
     Base/ThreadPool.h \
+    Base/Pipeline.h \
+    Base/Job.h \
     Plot/BasePlot.h \
     Data/Reader.h \
     Data/TimeEvents.h \
@@ -76,9 +87,13 @@ HEADERS  += mainwindow.h \
     Plot/PlotPair.h \
     Data/XValsTransform.h \
     Math/MassSpecSummator.h \
+    Math/SumKernels.h \
     Plot/DataPlot.h \
     Math/interpolator.h \
     Math/CurveFitting.h \
+    Math/MonteCarlo.h \
+    Math/FisherInformation.h \
+    Math/LevenbergMarquardt.h \
     Math/alglib/alglibinternal.h \
     Math/alglib/alglibmisc.h \
     Math/alglib/ap.h \
@@ -95,6 +110,11 @@ HEADERS  += mainwindow.h \
     Math/alglib/stdafx.h \
     Data/MassSpecImpl.h \
     Data/PackProc.h \
+    Data/PackArena.h \
+    Data/MassSpecCache.h \
+    Data/MassSpecBuilder.h \
+    Data/MassSpecStore.h \
+    Data/Ingest.h \
     Math/peakparams.h \
     Math/alglibspline.h
 